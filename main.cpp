@@ -2,44 +2,277 @@
 #include <utility>
 #include <vector>
 #include <optional>
-#include <functional>
+#include <new>
+#include <type_traits>
 #include <thread>
 #include <iomanip>
 #include <cstdio>
+#include <csignal>
 #include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <map>
+#include <deque>
+#include <list>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <coroutine>
+#include <array>
+#include <span>
+#include <charconv>
+#include <memory_resource>
 
 #include <systemd/sd-bus.h>
 #include <mosquitto.h>
-#include <expat.h>
 #include <magic_enum.hpp>
 #include <fmt/format.h>
 #include <fmt/ostream.h>
 
 #define LOG(f, ...) fmt::print(stderr, FMT_STRING(f "\n"), ##__VA_ARGS__)
 #define FMT(f, ...) fmt::format(FMT_STRING(f), ##__VA_ARGS__)
+// Formats into a string allocated from the per-dispatch arena
+#define AFMT(f, ...) arena_format(FMT_STRING(f), ##__VA_ARGS__)
 
 using namespace std::literals::chrono_literals;
 static constexpr char M223S_OFF_TOPIC[] = "home/m223s/off";
+static constexpr char M223S_START_TOPIC[] = "home/m223s/start";
 static constexpr char M223S_STATE_TOPIC[] = "home/m223s/state";
+static constexpr char M223S_METRICS_TOPIC[] = "home/m223s/metrics";
+static constexpr char M223S_STATUS_TOPIC[] = "home/m223s/status";
+static constexpr char M223S_LEASE_TOPIC[] = "home/m223s/lease";
+static constexpr char M223S_BRIDGES_TOPIC[] = "home/m223s/bridges";
+static constexpr char M223S_HISTORY_TOPIC[] = "home/m223s/history";
+static constexpr char M223S_HISTORY_RESULT_TOPIC[] = "home/m223s/history/result";
+static constexpr char M223S_HISTORY_EXPORT_TOPIC[] = "home/m223s/history/export";
+static constexpr char M223S_SESSION_TOPIC[] = "home/m223s/session";
+static constexpr char M223S_SCHEDULE_TOPIC[] = "home/m223s/schedule";
+static constexpr char M223S_SCHEDULE_RESULT_TOPIC[] = "home/m223s/schedule/result";
+static constexpr char M223S_ENROLL_TOPIC[] = "home/m223s/enroll";
+static constexpr char M223S_CONTROL_TOPIC[] = "home/m223s/control";
+static constexpr char M223S_CONTROL_RESULT_TOPIC[] = "home/m223s/control/result";
+static constexpr std::string_view SERVICE_UUID = "6e400001-b5a3-f393-e0a9-e50e24dcca9e";
 static constexpr char M223S_ADDR[] = "F9:DA:73:71:23:4A";
 static constexpr uint8_t M223S_KEY[8] = {0xa4, 0x3b, 0x64, 0xb0, 0xa3, 0xfb, 0xae, 0xcb};
 static constexpr std::string_view RX_UUID = "6e400003-b5a3-f393-e0a9-e50e24dcca9e";
 static constexpr std::string_view TX_UUID = "6e400002-b5a3-f393-e0a9-e50e24dcca9e";
-static constexpr int CMD_CODE_AUTH = 0xff;
-static constexpr int CMD_CODE_QUERY = 0x06;
-static constexpr int CMD_CODE_OFF = 0x04;
-static constexpr int CMD_CODE_PING = 0x01;
 static constexpr auto DISCOVERY_MIN_INTERVAL = 60s;
+static constexpr auto DISCOVERY_WINDOW = 5s;
+// Stop scanning on an adapter while it has commands in flight. Set to false to measure command latency
+// with concurrent scanning.
+static constexpr bool PAUSE_DISCOVERY_FOR_COMMANDS = true;
 static constexpr auto POLLING_INTERVAL = 7.5s;
+static constexpr auto ON_DEMAND_POLLING_INTERVAL = 60.0s;
+static constexpr auto LINK_IDLE_TIMEOUT = 5s;
 static constexpr auto WRITE_VALUE_TIMEOUT = 10s;
+// How long to wait for BlueZ to resolve GATT services after connecting
+static constexpr auto SERVICES_RESOLVE_TIMEOUT = 10s;
+// Concurrent D-Bus calls while looking up the GATT characteristics of a device
+static constexpr size_t GATT_RESOLVE_IN_FLIGHT = 8;
+// Frames fit into the default ATT MTU
+static constexpr size_t MAX_FRAME_SIZE = 20;
+// Frames written to a device are limited by a token bucket: TX_BURST frames at once, then one per
+// TX_REFILL_INTERVAL. Excess high priority frames wait, normal ones wait until TX_QUEUE_LIMIT frames are
+// waiting, low priority ones are rejected.
+static constexpr int TX_BURST = 4;
+static constexpr auto TX_REFILL_INTERVAL = 250ms;
+static constexpr size_t TX_QUEUE_LIMIT = 16;
+static constexpr auto METRICS_INTERVAL = 60s;
+// Dispatch order of event sources that are ready together, lower first: broker commands, device notifications
+// and D-Bus replies, then polls, timeouts and state publishing, then housekeeping (discovery, history answers,
+// metrics), which only runs when nothing else is ready
+static constexpr int64_t PRIORITY_COMMANDS = SD_EVENT_PRIORITY_IMPORTANT;
+static constexpr int64_t PRIORITY_STATE = SD_EVENT_PRIORITY_NORMAL;
+static constexpr int64_t PRIORITY_HOUSEKEEPING = SD_EVENT_PRIORITY_IDLE;
+// Synthetic contention for measuring dispatch latency: a state priority timer busy for SYNTHETIC_LOAD_BUSY
+// every SYNTHETIC_LOAD_PERIOD. Off while the period is 0.
+static constexpr auto SYNTHETIC_LOAD_PERIOD = 0ms;
+static constexpr auto SYNTHETIC_LOAD_BUSY = 2ms;
+// Temporaries of a single event loop dispatch (D-Bus paths, property values) are
+// bump-allocated from an arena of this size, which is reset after every dispatch
+static constexpr size_t ARENA_SIZE = 64 * 1024;
+static constexpr auto COMMAND_TTL = 5min;
+// Scheduled jobs per bridge, with request ids cut to SCHEDULE_REQUESTER_LIMIT the schedule file stays well
+// below the 16 KiB it's read with
+static constexpr size_t SCHEDULE_MAX_JOBS = 64;
+static constexpr size_t SCHEDULE_REQUESTER_LIMIT = 64;
+// The last decoded state of every device is checkpointed here, rewritten when it changes or every
+// STATE_CHECKPOINT_INTERVAL. On restart it's restored and left alone on the broker unless the device doesn't
+// confirm it within RESTORED_STATE_GRACE, then it's republished with "stale_since".
+static constexpr char STATE_DIR[] = "/var/lib/m223s-to-mqtt";
+static constexpr auto STATE_CHECKPOINT_INTERVAL = 5min;
+static constexpr auto RESTORED_STATE_GRACE = 30s;
+// Every decoded status is appended to a ring of this many records (16 bytes each) in STATE_DIR. A history
+// query returns at most HISTORY_QUERY_LIMIT records.
+static constexpr size_t HISTORY_CAPACITY = 64 * 1024;
+static constexpr size_t HISTORY_QUERY_LIMIT = 1000;
+// Packed history exports are streamed in messages of at most this size
+static constexpr size_t HISTORY_EXPORT_CHUNK = 4096;
+// Repeats of an idempotent command are merged into a queued or in-flight one, or into one completed less than
+// COMMAND_DEDUPE_WINDOW ago
+static constexpr auto COMMAND_DEDUPE_WINDOW = 3s;
+// Device ownership between bridge instances. The owner renews its leases every LEASE_RENEW_INTERVAL,
+// independently of the polling interval, so a dead owner's lease is released after LEASE_TTL at most (sooner
+// if its Last Will arrives first). An owner that has failed to open a session for LEASE_UNREACHABLE_TIMEOUT
+// stops renewing and only claims the device again with an unknown RSSI, so any instance still in range wins.
+// Takeover then takes up to DISCOVERY_MIN_INTERVAL + the polling interval more, until another instance sees
+// the device advertising. RSSI older than DISCOVERY_MIN_INTERVAL isn't used for takeover.
+static constexpr auto LEASE_TTL = 30s;
+static constexpr auto LEASE_RENEW_INTERVAL = LEASE_TTL / 3;
+static constexpr auto LEASE_UNREACHABLE_TIMEOUT = 2 * LEASE_TTL;
+static constexpr int LEASE_RSSI_HYSTERESIS = 6;
+static constexpr int RSSI_UNKNOWN = -127;
+static constexpr int MQTT_KEEPALIVE = 30;
+static constexpr char MQTT_HOST[] = "127.0.0.1";
+static constexpr int MQTT_PORT = 1883;
+// Read at startup and on SIGHUP or a reload command, M223S_CONFIG overrides the path. One setting per line:
+//   broker <host> [<port>]
+//   polling_interval <duration>
+//   metrics_interval <duration>
+//   auto_enroll on|off
+//   device <address> <model> <key in hex> [<state topic> <off topic> <start topic>]
+// Missing settings keep the defaults here, device lines replace DEVICES.
+static constexpr char CONFIG_FILE[] = "/etc/m223s-to-mqtt.conf";
+
+enum LinkPolicy {
+    // Keep the link up and poll every POLLING_INTERVAL
+    Always_connected,
+    // Connect for polls every ON_DEMAND_POLLING_INTERVAL and for commands, disconnect after LINK_IDLE_TIMEOUT
+    On_demand
+};
+
+static constexpr LinkPolicy LINK_POLICY = Always_connected;
+static constexpr auto LINK_POLLING_INTERVAL = LINK_POLICY == On_demand ? ON_DEMAND_POLLING_INTERVAL : POLLING_INTERVAL;
+
+// Supported cooker models, see Profile
+enum Model {
+    Rmc_m223s,
+};
+
+struct DeviceConfig {
+    Model model;
+    const char *addr;
+    const uint8_t *key;
+    const char *state_topic;
+    const char *off_topic;
+    const char *start_topic;
+};
+
+static constexpr DeviceConfig DEVICES[] = {
+    {Rmc_m223s, M223S_ADDR, M223S_KEY, M223S_STATE_TOPIC, M223S_OFF_TOPIC, M223S_START_TOPIC},
+};
+// Local automations, evaluated on every cooker status without a round trip through the broker:
+//   <field> <op> <value> [and ...] [for <duration>] -> <command>
+// Fields are state, program, temperature and time_left (minutes), ops are == != < <= > >=, durations are
+// like 90s, 30min or 3h. A rule fires once each time its conditions start holding (for the duration).
+static constexpr const char *RULES[] = {
+    "state == keep warm for 3h -> turn off",
+};
+// New cookers advertising SERVICE_UUID under a name matching one of ENROLL_MODELS (fnmatch patterns) are
+// enrolled while AUTO_ENROLL (or "auto_enroll on" in CONFIG_FILE) is on: a random key is generated and the
+// authorization is retried every ENROLL_AUTH_INTERVAL until the cooker accepts it (hold '+' on it) or
+// ENROLL_PAIRING_TIMEOUT passes. Keys are kept in STATE_DIR/enrolled. Adapters are scanned for new cookers
+// every ENROLL_DISCOVERY_INTERVAL. Off by default, as any matching cooker in range would be paired with, a
+// neighbour's included. Ignored with M223S_BRIDGE_ID set: keys only live on the enrolling instance, so no
+// other bridge could take the cooker over.
+static constexpr bool AUTO_ENROLL = false;
+struct EnrollPattern {
+    const char *name;
+    Model model;
+};
+static constexpr EnrollPattern ENROLL_MODELS[] = {
+    {"RMC-M223S*", Rmc_m223s},
+};
+static constexpr auto ENROLL_PAIRING_TIMEOUT = 2min;
+static constexpr auto ENROLL_AUTH_INTERVAL = 2s;
+static constexpr auto ENROLL_DISCOVERY_INTERVAL = 5min;
+static constexpr size_t MAX_KEY_SIZE = 16;
 
 template <typename T>
 std::chrono::microseconds to_us(T t) {
     return std::chrono::duration_cast<std::chrono::microseconds>(t);
 }
 
+// Move-only callable stored in a fixed buffer. A callable that doesn't fit fails to compile instead of
+// going to the heap.
+template <typename Signature, size_t Capacity = 32>
+class InplaceFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity> {
+public:
+    InplaceFunction() = default;
+
+    template <typename F>
+    requires(!std::is_same_v<std::decay_t<F>, InplaceFunction> && std::is_invocable_r_v<R, std::decay_t<F> &, Args...>)
+    InplaceFunction(F &&f) {
+        using T = std::decay_t<F>;
+        static_assert(sizeof(T) <= Capacity, "Callable doesn't fit into InplaceFunction, increase its capacity");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Callable is over-aligned for InplaceFunction");
+        static_assert(std::is_nothrow_move_constructible_v<T>, "Callable must be nothrow move constructible");
+        new (storage) T(std::forward<F>(f));
+        invoke = [](void *p, Args... args) -> R {
+            return (*(T *)p)(std::forward<Args>(args)...);
+        };
+        relocate = [](void *dst, void *src) {
+            if (dst) {
+                new (dst) T(std::move(*(T *)src));
+            }
+            ((T *)src)->~T();
+        };
+    }
+
+    InplaceFunction(InplaceFunction &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    InplaceFunction &operator=(InplaceFunction &&other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other.invoke) {
+                other.relocate(storage, other.storage);
+                invoke = std::exchange(other.invoke, nullptr);
+                relocate = std::exchange(other.relocate, nullptr);
+            }
+        }
+        return *this;
+    }
+
+    InplaceFunction(const InplaceFunction &) = delete;
+
+    InplaceFunction &operator=(const InplaceFunction &) = delete;
+
+    ~InplaceFunction() {
+        reset();
+    }
+
+    R operator()(Args... args) const {
+        return invoke(storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const {
+        return invoke != nullptr;
+    }
+
+private:
+    void reset() {
+        if (invoke) {
+            relocate(nullptr, storage);
+            invoke = nullptr;
+            relocate = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) mutable unsigned char storage[Capacity];
+    R (*invoke)(void *, Args...) = nullptr;
+    void (*relocate)(void *dst, void *src) = nullptr;
+};
+
 enum Program {
     Frying = 0,
     Cereals = 1,
@@ -68,6 +301,125 @@ enum State : int {
     Keep_warm = 6
 };
 
+// Accepted settings of a program, a start command outside them is refused without reaching the cooker
+struct ProgramLimits {
+    Program program;
+    int min_temperature;
+    int max_temperature;
+    int default_temperature;
+    std::chrono::minutes min_time;
+    std::chrono::minutes max_time;
+    std::chrono::minutes default_time;
+    bool delay;
+};
+
+static constexpr ProgramLimits M223S_PROGRAM_LIMITS[] = {
+    {Frying, 100, 180, 160, 5min, 90min, 15min, false},
+    {Cereals, 100, 100, 100, 5min, 4h, 35min, true},
+    {Multicooker, 35, 180, 100, 2min, 15h, 30min, true},
+    {Pilau, 100, 120, 110, 30min, 2h, 1h, true},
+    {Steam, 100, 100, 100, 5min, 2h, 30min, true},
+    {Baking, 100, 160, 140, 20min, 8h, 45min, true},
+    {Stew, 90, 100, 95, 1h, 12h, 1h, true},
+    {Soup, 95, 100, 98, 20min, 8h, 1h, true},
+    {Milk_porridge, 90, 95, 92, 5min, 90min, 25min, true},
+    {Yoghurt, 35, 40, 38, 1h, 12h, 8h, true},
+    {Express, 100, 120, 110, 5min, 1h, 20min, false},
+    {Warming, 60, 75, 70, 1min, 12h, 20min, false},
+};
+
+static constexpr auto MAX_START_DELAY = 24h;
+
+struct CommandCodes {
+    uint8_t auth;
+    uint8_t ping;
+    uint8_t query;
+    uint8_t off;
+    uint8_t set_program;
+    uint8_t start;
+};
+
+// Offsets of the status response fields, counted from the start of the frame
+struct StatusLayout {
+    size_t size;
+    size_t program;
+    size_t temperature;
+    size_t hours;
+    size_t minutes;
+    size_t state;
+};
+
+// Everything that differs between cooker models. A model specializes Profile with its descriptors, and
+// decoding and encoding are instantiated for it, so only the entry points switch on the device's model.
+template <Model M>
+struct Profile;
+
+template <>
+struct Profile<Rmc_m223s> {
+    static constexpr size_t key_size = sizeof(M223S_KEY);
+    static constexpr CommandCodes commands{0xff, 0x01, 0x06, 0x04, 0x05, 0x03};
+    static constexpr StatusLayout status{20, 3, 5, 8, 9, 11};
+    // Indexed by the program and state codes of the device
+    static constexpr Program programs[] = {Frying, Cereals, Multicooker, Pilau, Steam, Baking, Stew, Soup,
+                                           Milk_porridge, Yoghurt, Express, Warming};
+    static constexpr State states[] = {Off, Setting, Delayed, Heating, Unknown, On, Keep_warm};
+    static constexpr std::span<const ProgramLimits> limits = M223S_PROGRAM_LIMITS;
+};
+
+template <typename P>
+constexpr const ProgramLimits *find_limits(Program program) {
+    for (auto &l : P::limits) {
+        if (l.program == program) {
+            return &l;
+        }
+    }
+    return nullptr;
+}
+
+template <typename P>
+constexpr std::optional<uint8_t> program_code(Program program) {
+    for (size_t i = 0; i < std::size(P::programs); i++) {
+        if (P::programs[i] == program) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+template <typename P>
+consteval bool valid_profile() {
+    auto &s = P::status;
+    if (P::key_size > MAX_KEY_SIZE || std::max({s.program, s.temperature, s.hours, s.minutes, s.state}) >= s.size) {
+        return false;
+    }
+    for (auto program : P::programs) {
+        auto l = find_limits<P>(program);
+        if (!l || l->min_temperature > l->default_temperature || l->default_temperature > l->max_temperature ||
+            l->min_time > l->default_time || l->default_time > l->max_time) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(valid_profile<Profile<Rmc_m223s>>(), "Keys must fit MAX_KEY_SIZE, status fields the frame, and every program needs consistent limits");
+
+// Calls f with the profile of the model, the only runtime dispatch on the model
+template <typename F>
+decltype(auto) with_profile(Model model, F &&f) {
+    switch (model) {
+    case Rmc_m223s:
+        return f(Profile<Rmc_m223s>{});
+    }
+    abort();
+}
+
+const ProgramLimits *program_limits(Model model, Program program) {
+    return with_profile(model, [program]<typename P>(P) {
+        return find_limits<P>(program);
+    });
+}
+
 struct DeviceState {
     uint8_t ctr = 0;
     Program program = Frying;
@@ -75,535 +427,4098 @@ struct DeviceState {
     int temperature = 0;
     int hours = 0;
     int minutes = 0;
-    void publish();
 
-    std::string to_json();
+    std::string to_json(std::optional<std::chrono::system_clock::time_point> stale_since = std::nullopt);
+};
 
-    void update_state(State state);
+struct HistoryRecord {
+    // Unix time, never decreasing within a file
+    int64_t time_ms;
+    int8_t state;
+    uint8_t program;
+    uint8_t temperature;
+    uint8_t hours;
+    uint8_t minutes;
+    uint8_t reserved[3];
+};
+static_assert(sizeof(HistoryRecord) == 16);
 
-    void update_state(State state, Program program, int temperature, int hours, int minutes);
+struct HistoryHeader {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t capacity;
+    // Logical indices of the records held, [tail, head). head counts the records ever appended and is bumped
+    // only after the record is written. Once the ring is full, tail is moved past the slot about to be
+    // overwritten before it's written, so a crash never exposes a torn record.
+    uint64_t head;
+    uint64_t tail;
+    uint8_t reserved[32];
 };
+static_assert(sizeof(HistoryHeader) == 64);
 
-struct {
-    sd_bus *bus = nullptr;
-    mosquitto *mqtt = nullptr;
-    sd_event *event = nullptr;
-    std::vector<std::string> adapters;
+// Status history in a memory-mapped ring file. Appending is O(1) and doesn't allocate.
+class History {
+public:
+    static constexpr uint32_t MAGIC = 0x4d323233;
+
+    History() = default;
+
+    History(const History &) = delete;
+
+    History &operator=(const History &) = delete;
+
+    ~History();
+
+    bool open(const std::string &path);
+
+    void append(const DeviceState &state);
+
+    // Logical indices of the records held, [begin(), end())
+    uint64_t begin() const;
+
+    uint64_t end() const;
+
+    const HistoryRecord &at(uint64_t index) const;
+
+    // First record at or after time_ms
+    uint64_t lower_bound(int64_t time_ms) const;
+
+private:
+    HistoryHeader *header = nullptr;
+    HistoryRecord *records = nullptr;
+    size_t size = 0;
+};
+
+struct Device;
+
+// Aggregates of a cooking session, updated in O(1) per status. A session starts when the cooker leaves Off or
+// Setting for Delayed, Heating or On and ends when it reaches Keep_warm or Off.
+struct CookingSession {
+    bool active = false;
+    Program program = Frying;
+    std::chrono::system_clock::time_point start;
+    std::chrono::steady_clock::time_point last_sample;
+    State last_state = Off;
+    std::array<std::chrono::milliseconds, magic_enum::enum_count<State>()> time_in_state{};
+    int peak_temperature = 0;
+    // First and latest sample while heating
+    std::optional<std::pair<std::chrono::steady_clock::time_point, int>> heating_start;
+    std::pair<std::chrono::steady_clock::time_point, int> heating_last;
+
+    std::string to_json(const Device &d);
+};
+
+// Heap allocations made by the process, for the metrics
+static constinit std::atomic<uint64_t> heap_allocation_count{0};
+
+void *operator new(size_t size) {
+    heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// Upstream of the arena, only used when a dispatch outgrows ARENA_SIZE
+class CountingResource : public std::pmr::memory_resource {
+public:
+    uint64_t allocations = 0;
+
+private:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        allocations++;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+// Coroutine frames are recycled through free lists by size class instead of going back to the heap
+struct FramePool {
+    static constexpr size_t CLASS_SIZES[] = {128, 256, 512, 1024, 2048};
+    std::array<std::vector<void *>, std::size(CLASS_SIZES)> free_lists;
+    uint64_t frames = 0;
+    uint64_t heap_allocations = 0;
+
+    void *allocate(size_t size);
+
+    void deallocate(void *p, size_t size);
+};
+
+void *allocate_frame(size_t size);
+
+void deallocate_frame(void *p, size_t size);
+
+// Lazily started coroutine returning 0 or a negative errno. Awaiting a Task starts it and resumes the
+// awaiter when it finishes; spawn() runs one detached.
+class Task {
+public:
+    struct promise_type {
+        int result = 0;
+        bool detached = false;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() {
+            return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        auto final_suspend() noexcept {
+            struct FinalAwaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    auto continuation = h.promise().continuation;
+                    if (h.promise().detached) {
+                        h.destroy();
+                    }
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+            return FinalAwaiter{};
+        }
+
+        void return_value(int r) {
+            result = r;
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+
+        static void *operator new(size_t size) {
+            return allocate_frame(size);
+        }
+
+        static void operator delete(void *p, size_t size) {
+            deallocate_frame(p, size);
+        }
+    };
+
+    Task(Task &&other) noexcept : h(std::exchange(other.h, nullptr)) {}
+
+    Task(const Task &) = delete;
+
+    ~Task() {
+        if (h) {
+            h.destroy();
+        }
+    }
+
+    bool await_ready() {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+        h.promise().continuation = awaiter;
+        return h;
+    }
+
+    int await_resume() {
+        return h.promise().result;
+    }
+
+    friend void spawn(Task task);
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+
+    std::coroutine_handle<promise_type> h;
+};
+
+void spawn(Task task) {
+    auto h = std::exchange(task.h, nullptr);
+    h.promise().detached = true;
+    h.resume();
+}
+
+// Frame written to the device, completed by its response or a failure
+struct Request {
+    std::coroutine_handle<> waiter;
+    int *result = nullptr;
+    std::chrono::steady_clock::time_point sent_time;
+    bool during_discovery = false;
+};
+
+enum CommandKind {
+    Turn_off,
+    Start,
+};
+
+struct StartParams {
+    Program program = Frying;
+    int temperature = 0;
+    std::chrono::minutes time{0};
+    std::chrono::minutes delay{0};
+};
+
+enum Priority {
+    Low = 0,
+    Normal = 1,
+    High = 2
+};
+
+// Device command waiting for an authorized session, dropped and reported when deadline passes
+struct Command {
+    CommandKind kind = Turn_off;
+    Priority priority = Normal;
+    std::chrono::steady_clock::time_point received;
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t id = 0;
+    // Request ids (empty if not given) of everyone waiting for the result
+    std::vector<std::string> requesters;
+    StartParams start{};
+};
+
+enum RuleField {
+    Field_state,
+    Field_program,
+    Field_temperature,
+    Field_time_left,
+};
+
+enum RuleOp {
+    Op_eq,
+    Op_ne,
+    Op_lt,
+    Op_le,
+    Op_gt,
+    Op_ge,
+};
+
+struct RuleCondition {
+    RuleField field;
+    RuleOp op;
+    int value;
+};
+
+// Compiled rule, its conditions are a slice of the flat condition table
+struct Rule {
+    std::string_view source;
+    uint32_t first_condition = 0;
+    uint32_t conditions = 0;
+    std::chrono::milliseconds hold{0};
+    CommandKind action = Turn_off;
+};
+
+// Per device evaluation state of a rule
+struct RuleState {
+    std::chrono::steady_clock::time_point held_since{std::chrono::seconds{0}};
+    bool holding = false;
+    bool fired = false;
+};
+
+// Command to run at a wall-clock time
+struct ScheduledJob {
+    uint64_t id = 0;
+    std::string device;
+    CommandKind command = Turn_off;
+    // Unix time
+    int64_t at_ms = 0;
+    // Set for "in" jobs until a restart, they run on the monotonic clock so wall-clock steps don't move them
+    std::optional<std::chrono::steady_clock::time_point> due;
+    std::string requester;
+    sd_event_source *source = nullptr;
+};
+
+// Writer waiting for a token
+struct TxFrame {
+    std::coroutine_handle<> waiter;
+    int *result = nullptr;
+    Priority priority = Normal;
+};
+
+struct TokenBucket {
+    double tokens = TX_BURST;
+    std::chrono::steady_clock::time_point last_refill = std::chrono::steady_clock::now();
+
+    void refill();
+
+    bool take();
+
+    std::chrono::microseconds time_to_token();
+};
+
+struct Lease {
+    std::string owner;
+    int rssi = RSSI_UNKNOWN;
+    std::chrono::steady_clock::time_point expires{std::chrono::seconds{0}};
+};
+
+// Device1 properties, cached from PropertiesChanged signals
+struct LinkProperties {
+    bool connected = false;
+    bool services_resolved = false;
+    bool paired = false;
+};
+
+struct Device {
+    size_t index = 0;
+    const DeviceConfig *config = nullptr;
+    // Enrolled, but the cooker hasn't accepted its key yet. It's not polled until then.
+    bool pairing = false;
+    // Dropped from the config by a reload. The Device is kept, as request keys index g.devices, but it's
+    // unsubscribed and no longer polled.
+    bool removed = false;
+    sd_event_source *poll_source = nullptr;
+    std::string lease_topic;
+    Lease lease;
+    int rssi = RSSI_UNKNOWN;
+    // BlueZ only reports RSSI while discovering
+    std::chrono::steady_clock::time_point rssi_at{std::chrono::seconds{0}};
+    // Since when sessions fail to open, zero once one succeeds
+    std::chrono::steady_clock::time_point unreachable_since{std::chrono::seconds{0}};
+    std::string adapter;
     std::string device_path;
+    sd_bus_slot *props_slot = nullptr;
+    LinkProperties link;
+    // Bumped when the link goes down, request numbers restart with the next session
+    uint32_t link_generation = 0;
+    // Sessions waiting for ServicesResolved
+    std::vector<std::pair<std::coroutine_handle<>, int *>> resolve_waiters;
+    sd_event_source *resolve_source = nullptr;
     std::string tx_path;
     std::string rx_path;
     sd_bus_slot *rx_slot = nullptr;
-    int event_fd = -1;
-    std::chrono::steady_clock::time_point last_start_discovery_time{std::chrono::seconds{0}};
+    // Socket from AcquireWrite: frames written to it skip D-Bus marshalling. -1 if not acquired.
+    int write_fd = -1;
+    uint16_t write_mtu = 0;
+    sd_event_source *idle_source = nullptr;
+    sd_event_source *expiry_source = nullptr;
+    std::vector<Command> commands;
+    std::vector<Command> sent_commands;
+    std::map<CommandKind, std::chrono::steady_clock::time_point> last_done;
+    TokenBucket tx_bucket;
+    std::deque<TxFrame> tx_queue;
+    sd_event_source *tx_source = nullptr;
+    // Concurrent open_session() calls wait for the one in progress
+    bool session_opening = false;
+    std::vector<std::pair<std::coroutine_handle<>, int *>> session_waiters;
+    std::chrono::steady_clock::time_point connected_since{std::chrono::seconds{0}};
     DeviceState device_state{};
-    std::map<uint8_t, std::function<void()>> request_handlers;
-} g;
+    std::string state_file;
+    DeviceState saved{};
+    std::chrono::system_clock::time_point saved_at;
+    // State restored from disk, until the device reports again
+    std::optional<DeviceState> restored;
+    History history;
+    CookingSession session;
+    std::vector<RuleState> rule_states;
+    bool restored_stale = false;
+    sd_event_source *stale_source = nullptr;
+    std::map<uint8_t, Request> request_handlers;
+    // Results of pipelined requests completed before anyone awaited them
+    std::map<uint8_t, int> early_results;
 
-sd_bus *init_sd_bus() {
-    sd_bus *bus;
-    int r = sd_bus_default_system(&bus);
-    if (r < 0) {
-        LOG("Can't open system bus");
-        exit(0);
-    }
-    return bus;
-}
+    void publish();
 
-std::pair<std::vector<std::string>, std::string> introspect(const std::string &dest, const std::string &path) {
-    std::pair<std::vector<std::string>, std::string> ret;
+    void update_state(State state);
 
-    sd_bus_message *reply = NULL;
-    sd_bus_error e = SD_BUS_ERROR_NULL;
-    int r = sd_bus_call_method(g.bus, dest.c_str(), path.c_str(), "org.freedesktop.DBus.Introspectable", "Introspect", &e, &reply, "");
-    if (r < 0) {
-        LOG("Can't enumerate nodes: {}", r);
-        return ret;
+    void update_state(State state, Program program, int temperature, int hours, int minutes);
+};
+
+// Discovery on an adapter runs in windows of DISCOVERY_WINDOW at most once per DISCOVERY_MIN_INTERVAL.
+// Inside a window scanning is paused while any device on the adapter has requests in flight.
+struct Adapter {
+    std::string name;
+    std::string path;
+    bool discovery_pending = false;
+    bool discovering = false;
+    int in_flight = 0;
+    std::chrono::steady_clock::time_point last_start_discovery_time{std::chrono::seconds{0}};
+    std::chrono::steady_clock::time_point discovery_window_end{std::chrono::seconds{0}};
+};
+
+struct LatencyStats {
+    uint64_t count = 0;
+    std::chrono::microseconds total{0};
+    std::chrono::microseconds max{0};
+
+    void add(std::chrono::microseconds latency);
+
+    std::string to_json();
+};
+
+// Size and speed of history answers in one format
+struct ExportStats {
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    LatencyStats time;
+
+    void add(uint64_t records, uint64_t bytes, std::chrono::microseconds time);
+
+    std::string to_json();
+};
+
+// Startup milestones, each recorded the first time it's reached
+enum StartupPhase {
+    Bus_opened,
+    Broker_connected,
+    Adapters_enumerated,
+    Device_found,
+    Device_ready,
+    State_published,
+};
+
+struct Metrics {
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    std::array<std::optional<std::chrono::microseconds>, magic_enum::enum_count<StartupPhase>()> startup;
+    LatencyStats latency_idle;
+    LatencyStats latency_scanning;
+    // Connect to authorized, and command received to command acknowledged
+    LatencyStats session_setup;
+    // Time to scan an Introspect reply
+    LatencyStats introspection;
+    // Time to find the RX and TX characteristics, D-Bus calls made and cancelled for it
+    LatencyStats gatt_resolve;
+    uint64_t gatt_calls = 0;
+    uint64_t gatt_cancelled = 0;
+    LatencyStats command;
+    // Start command received to the cooker confirmed running
+    LatencyStats start;
+    uint64_t connections = 0;
+    std::chrono::microseconds connected_time{0};
+    uint64_t merged_commands = 0;
+    uint64_t delayed_writes = 0;
+    uint64_t rejected_writes = 0;
+    // Time to build and send a frame through the acquired socket or as a WriteValue call
+    LatencyStats marshal_fd;
+    LatencyStats marshal_dbus;
+    ExportStats history_json;
+    ExportStats history_packed;
+    // Scheduled job run time past its target
+    LatencyStats schedule_jitter;
+    // Time from an event (message received, timer due, work deferred) to its dispatch, per priority class
+    LatencyStats dispatch_commands;
+    LatencyStats dispatch_state;
+    LatencyStats dispatch_housekeeping;
+    // Time to apply a reloaded config, and links it had to drop because a device's key or model changed
+    LatencyStats reload;
+    uint64_t reload_reconnects = 0;
+    uint64_t workflows = 0;
+    uint64_t dispatches = 0;
+
+    void mark(StartupPhase phase);
+
+    void publish();
+};
+
+// Config of a device enrolled at runtime or read from CONFIG_FILE, owns everything its DeviceConfig points to
+struct OwnedDeviceConfig {
+    std::string addr;
+    Model model = Rmc_m223s;
+    std::array<uint8_t, MAX_KEY_SIZE> key{};
+    std::string state_topic;
+    std::string off_topic;
+    std::string start_topic;
+    DeviceConfig config{};
+
+    // Points config at the owned fields, again after every copy
+    void bind() {
+        config = DeviceConfig{model, addr.c_str(), key.data(), state_topic.c_str(), off_topic.c_str(), start_topic.c_str()};
     }
+};
 
-    const char *s = nullptr;
-    sd_bus_message_read(reply, "s", &s);
-    //LOG("{}", s);
+struct Settings {
+    std::string broker_host = MQTT_HOST;
+    int broker_port = MQTT_PORT;
+    std::chrono::milliseconds polling_interval = std::chrono::duration_cast<std::chrono::milliseconds>(LINK_POLLING_INTERVAL);
+    std::chrono::milliseconds metrics_interval = METRICS_INTERVAL;
+    bool auto_enroll = AUTO_ENROLL;
+    // Empty unless the config file lists devices
+    std::vector<OwnedDeviceConfig> devices;
+};
 
-    auto parser = XML_ParserCreate("utf-8");
-    auto onStartElement = [&](const char *name, const char **attrs){
-        if (!strcmp(name, "node")) {
-            for (const char **it = attrs; *it; it += 2) {
-                if (!strcmp(it[0], "name")) {
-                    ret.first.emplace_back(it[1]);
-                }
+struct MqttMessage {
+    std::string topic;
+    std::string payload;
+    std::chrono::steady_clock::time_point received;
+};
+
+struct {
+    sd_bus *bus = nullptr;
+    mosquitto *mqtt = nullptr;
+    sd_event *event = nullptr;
+    std::vector<Adapter> adapters;
+    std::vector<std::unique_ptr<Device>> devices;
+    std::list<OwnedDeviceConfig> enrolled;
+    // Copies of the configs of devices a reload dropped, the settings they pointed into are gone
+    std::list<OwnedDeviceConfig> retired;
+    Settings settings;
+    // Idle priority source running run_housekeeping(), enabled by schedule_housekeeping()
+    sd_event_source *housekeeping_source = nullptr;
+    std::optional<std::chrono::steady_clock::time_point> housekeeping_since;
+    // Messages left for housekeeping, like history queries
+    std::vector<MqttMessage> deferred_messages;
+    // One enrollment at a time, other candidates are picked up when they advertise again
+    bool enrolling = false;
+    // The InterfacesAdded match and the scan timer, set up the first time auto_enroll is on
+    bool enrollment_started = false;
+    Metrics metrics;
+    FramePool frame_pool;
+    std::array<std::byte, ARENA_SIZE> arena_buffer;
+    CountingResource arena_upstream;
+    std::pmr::monotonic_buffer_resource arena{arena_buffer.data(), arena_buffer.size(), &arena_upstream};
+    // Empty unless M223S_BRIDGE_ID is set, in which case devices are only managed under a lease
+    std::string bridge_id;
+    std::set<std::string> bridges;
+    std::atomic<bool> mqtt_connected = false;
+    // Set by the mosquitto thread on CONNACK, handled by the event loop
+    std::atomic<bool> broker_accepted = false;
+    uint64_t next_command_id = 1;
+    std::vector<Rule> rules;
+    std::vector<RuleCondition> rule_conditions;
+    std::map<uint64_t, ScheduledJob> jobs;
+    uint64_t next_job_id = 1;
+    // Messages handed over from the mosquitto thread to the event loop
+    std::mutex inbox_mutex;
+    std::vector<MqttMessage> inbox;
+    int inbox_fd = -1;
+} g;
+
+void *FramePool::allocate(size_t size) {
+    frames++;
+    for (size_t i = 0; i < std::size(CLASS_SIZES); i++) {
+        if (size <= CLASS_SIZES[i]) {
+            if (!free_lists[i].empty()) {
+                void *p = free_lists[i].back();
+                free_lists[i].pop_back();
+                return p;
             }
+            heap_allocations++;
+            return ::operator new(CLASS_SIZES[i]);
         }
-        if (!strcmp(name, "interface")) {
-            for (const char **it = attrs; *it; it += 2) {
-                if (!strcmp(it[0], "name")) {
-                    if (!strncmp(it[1], dest.data(), dest.size())) {
-                        ret.second = it[1];
-                    }
-                }
-            }
+    }
+    heap_allocations++;
+    return ::operator new(size);
+}
+
+void FramePool::deallocate(void *p, size_t size) {
+    for (size_t i = 0; i < std::size(CLASS_SIZES); i++) {
+        if (size <= CLASS_SIZES[i]) {
+            free_lists[i].push_back(p);
+            return;
         }
+    }
+    ::operator delete(p);
+}
+
+void *allocate_frame(size_t size) {
+    return g.frame_pool.allocate(size);
+}
+
+void deallocate_frame(void *p, size_t size) {
+    g.frame_pool.deallocate(p, size);
+}
+
+// Awaits the reply to an asynchronous method call, which is consumed. Resumes with 0 or a negative errno.
+struct BusCall {
+    sd_bus_message *m;
+    uint64_t timeout_usec;
+    std::coroutine_handle<> waiter;
+    int r = 0;
+    std::string error_name;
+
+    bool await_ready() {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        r = sd_bus_call_async(g.bus, nullptr, m, [](sd_bus_message *reply, void *userdata, sd_bus_error *ret_error){
+            auto &self = *(BusCall *)userdata;
+            if (sd_bus_message_is_method_error(reply, nullptr)) {
+                const sd_bus_error *e = sd_bus_message_get_error(reply);
+                self.r = -sd_bus_message_get_errno(reply);
+                self.error_name = e && e->name ? e->name : "";
+            }
+            self.waiter.resume();
+            return 0;
+        }, this, timeout_usec);
+        sd_bus_message_unref(m);
+        return r >= 0;
+    }
+
+    int await_resume() {
+        return r;
+    }
+};
+
+// Gives a source its priority and hands it over to the loop, as if it was added without a ret pointer
+void float_source(sd_event_source *s, int64_t priority) {
+    if (!s) {
+        return;
+    }
+    sd_event_source_set_priority(s, priority);
+    sd_event_source_set_floating(s, true);
+    sd_event_source_unref(s);
+}
+
+void schedule_housekeeping() {
+    if (!g.housekeeping_since) {
+        g.housekeeping_since = std::chrono::steady_clock::now();
+    }
+    sd_event_source_set_enabled(g.housekeeping_source, SD_EVENT_ONESHOT);
+}
+
+sd_bus *init_sd_bus() {
+    sd_bus *bus;
+    int r = sd_bus_default_system(&bus);
+    if (r < 0) {
+        LOG("Can't open system bus");
+        exit(0);
+    }
+    return bus;
+}
+
+template <typename... Args>
+std::pmr::string arena_format(fmt::format_string<Args...> f, Args &&...args) {
+    std::pmr::string ret(&g.arena);
+    fmt::format_to(std::back_inserter(ret), f, std::forward<Args>(args)...);
+    return ret;
+}
+
+// Forward-only scanner over an Introspect reply. Yields the names of child <node>s and <interface>s as views
+// into the reply, without building a document or copying anything.
+class IntrospectionScanner {
+public:
+    enum Kind {
+        Node,
+        Interface,
+    };
+
+    struct Element {
+        Kind kind;
+        std::string_view name;
     };
-    XML_SetUserData(parser, &onStartElement);
-    XML_SetElementHandler(parser, [](void *arg, const char *name, const char **attrs){
-        auto *f = (decltype(onStartElement) *)arg;
-        (*f)(name, attrs);
-    },nullptr);
-    XML_Parse(parser, s, strlen(s), true);
-    XML_ParserFree(parser);
+
+    explicit IntrospectionScanner(std::string_view xml) : xml(xml) {}
+
+    std::optional<Element> next() {
+        while ((pos = xml.find('<', pos)) != std::string_view::npos) {
+            pos++;
+            if (xml.substr(pos, 3) == "!--") {
+                pos = xml.find("-->", pos);
+                continue;
+            }
+            auto tag_end = xml.find_first_of(" \t\r\n/>", pos);
+            if (tag_end == std::string_view::npos) {
+                break;
+            }
+            auto tag = xml.substr(pos, tag_end - pos);
+            pos = tag_end;
+            Kind kind;
+            if (tag == "node") {
+                kind = Node;
+            } else if (tag == "interface") {
+                kind = Interface;
+            } else {
+                // '<' can't appear inside attribute values, so other tags are skipped by the find above
+                continue;
+            }
+            auto name = name_attribute();
+            // The outermost <node> is the introspected object itself
+            bool root = kind == Node && !seen_root;
+            seen_root = seen_root || kind == Node;
+            if (name && !root) {
+                return Element{kind, *name};
+            }
+        }
+        pos = xml.size();
+        return std::nullopt;
+    }
+
+private:
+    std::string_view xml;
+    size_t pos = 0;
+    bool seen_root = false;
+
+    // Reads the attributes up to the end of the tag, returns the value of `name`
+    std::optional<std::string_view> name_attribute() {
+        std::optional<std::string_view> ret;
+        while (true) {
+            pos = xml.find_first_not_of(" \t\r\n", pos);
+            if (pos == std::string_view::npos || xml[pos] == '>' || xml[pos] == '/') {
+                pos = pos == std::string_view::npos ? xml.size() : pos + 1;
+                return ret;
+            }
+            auto eq = xml.find('=', pos);
+            auto quote = xml.find_first_of("\"'", eq);
+            if (eq == std::string_view::npos || quote == std::string_view::npos) {
+                pos = xml.size();
+                return ret;
+            }
+            auto key = xml.substr(pos, xml.find_last_not_of(" \t\r\n", eq - 1) + 1 - pos);
+            auto end = xml.find(xml[quote], quote + 1);
+            if (end == std::string_view::npos) {
+                pos = xml.size();
+                return ret;
+            }
+            if (key == "name") {
+                ret = xml.substr(quote + 1, end - quote - 1);
+            }
+            pos = end + 1;
+        }
+    }
+};
+
+// Calls f(kind, name) for the child nodes and interfaces of `path` until it returns false. Names are only
+// valid during the call.
+int introspect(const char *dest, const char *path,
+               const InplaceFunction<bool(IntrospectionScanner::Kind kind, std::string_view name)> &f) {
+    sd_bus_message *reply = NULL;
+    sd_bus_error e = SD_BUS_ERROR_NULL;
+    int r = sd_bus_call_method(g.bus, dest, path, "org.freedesktop.DBus.Introspectable", "Introspect", &e, &reply, "");
+    if (r < 0) {
+        LOG("Can't enumerate nodes: {}", r);
+        sd_bus_error_free(&e);
+        return r;
+    }
+
+    const char *s = nullptr;
+    sd_bus_message_read(reply, "s", &s);
+    //LOG("{}", s);
+
+    auto start = std::chrono::steady_clock::now();
+    IntrospectionScanner scanner(s ? s : "");
+    while (auto element = scanner.next()) {
+        if (!f(element->kind, element->name)) {
+            break;
+        }
+    }
+    g.metrics.introspection.add(to_us(std::chrono::steady_clock::now() - start));
     sd_bus_message_unref(reply);
-    return ret;
+    return 0;
+}
+
+bool start_discovery(const Adapter &adapter) {
+    sd_bus_message *reply = nullptr;
+    sd_bus_error e = SD_BUS_ERROR_NULL;
+    int r = sd_bus_call_method(g.bus, "org.bluez", adapter.path.c_str(),
+                               "org.bluez.Adapter1", "StartDiscovery", &e, &reply, "");
+    if (r < 0) {
+        LOG("Can't start discovery on {}: {}", adapter.name, strerror(-r));
+        return false;
+    }
+    LOG("Started discovery on {}", adapter.name);
+    sd_bus_message_unref(reply);
+    return true;
+}
+
+int stop_discovery(const Adapter &adapter) {
+    sd_bus_message *reply = nullptr;
+    sd_bus_error e = SD_BUS_ERROR_NULL;
+    int r = sd_bus_call_method(g.bus, "org.bluez", adapter.path.c_str(),
+                               "org.bluez.Adapter1", "StopDiscovery", &e, &reply, "");
+    if (r < 0) {
+        LOG("Can't stop discovery on {}: {}", adapter.name, r);
+        return r;
+    } else {
+        LOG("Stopped discovery on {}", adapter.name);
+    }
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+Adapter *find_adapter(const std::string &name) {
+    for (auto &a : g.adapters) {
+        if (a.name == name) {
+            return &a;
+        }
+    }
+    return nullptr;
+}
+
+int on_discovery_window_end(sd_event_source *s, uint64_t usec, void *userdata) {
+    auto &a = *(Adapter *)userdata;
+    if (a.discovering) {
+        stop_discovery(a);
+        a.discovering = false;
+    }
+    return 0;
+}
+
+// Starts (or resumes a paused) discovery window unless requests are in flight on the adapter.
+void resume_discovery(Adapter &a) {
+    if (a.discovering || (PAUSE_DISCOVERY_FOR_COMMANDS && a.in_flight > 0)) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (a.discovery_pending) {
+        a.discovery_pending = false;
+        a.last_start_discovery_time = now;
+        a.discovery_window_end = now + DISCOVERY_WINDOW;
+        sd_event_source *window = nullptr;
+        sd_event_add_time_relative(g.event, &window, CLOCK_MONOTONIC, to_us(DISCOVERY_WINDOW).count(), 0,
+                                   on_discovery_window_end, &a);
+        float_source(window, PRIORITY_HOUSEKEEPING);
+    } else if (now >= a.discovery_window_end) {
+        return;
+    }
+    a.discovering = start_discovery(a);
+}
+
+void pause_discovery(Adapter &a) {
+    if (!PAUSE_DISCOVERY_FOR_COMMANDS || !a.discovering) {
+        return;
+    }
+    LOG("Pausing discovery on {}", a.name);
+    stop_discovery(a);
+    a.discovering = false;
+}
+
+void request_discovery(Adapter &a) {
+    auto now = std::chrono::steady_clock::now();
+    if (a.discovery_pending || now < a.discovery_window_end) {
+        return;
+    }
+    if (a.last_start_discovery_time + DISCOVERY_MIN_INTERVAL > now) {
+        LOG("Skipping discovery on {}", a.name);
+        return;
+    }
+    a.discovery_pending = true;
+    schedule_housekeeping();
+}
+
+// Accounts a request on the device's adapter. Returns true if it overlaps a discovery window.
+bool begin_request(Device &d) {
+    Adapter *a = find_adapter(d.adapter);
+    if (!a) {
+        return false;
+    }
+    bool during_discovery = a->discovering || std::chrono::steady_clock::now() < a->discovery_window_end;
+    if (a->in_flight++ == 0) {
+        pause_discovery(*a);
+    }
+    return during_discovery;
+}
+
+void end_request(Device &d) {
+    Adapter *a = find_adapter(d.adapter);
+    // Resumed as housekeeping, the StartDiscovery call doesn't hold up the notification being handled
+    if (a && a->in_flight > 0 && --a->in_flight == 0) {
+        schedule_housekeeping();
+    }
+}
+
+void complete_request(Device &d, uint8_t req_num, Request &req, int r) {
+    if (!req.waiter) {
+        d.early_results[req_num] = r;
+        return;
+    }
+    *req.result = r;
+    req.waiter.resume();
+}
+
+// Fails everything in flight or waiting for a token, e.g. when the link is reset
+void clear_requests(Device &d) {
+    auto request_handlers = std::move(d.request_handlers);
+    d.request_handlers.clear();
+    auto tx_queue = std::move(d.tx_queue);
+    d.tx_queue.clear();
+    for (auto &[req_num, req] : request_handlers) {
+        end_request(d);
+        complete_request(d, req_num, req, -ECONNRESET);
+    }
+    // Request numbers restart with the next session, results nobody awaited must not leak into it. Waiters
+    // resumed above find their other requests gone instead (see Response).
+    d.early_results.clear();
+    for (auto &frame : tx_queue) {
+        *frame.result = -ECONNRESET;
+        frame.waiter.resume();
+    }
+}
+
+std::pmr::string get_string_property(const char *node, const char *interface, const char *member) {
+    sd_bus_message *reply = nullptr;
+    sd_bus_error e = SD_BUS_ERROR_NULL;
+    int r = sd_bus_get_property(g.bus, "org.bluez", node,
+                                interface, member, &e, &reply, "s");
+    if (r < 0) {
+        return std::pmr::string(&g.arena);
+    }
+    const char *str;
+    sd_bus_message_read(reply, "s", &str);
+    std::pmr::string ret_str(str, &g.arena);
+    sd_bus_message_unref(reply);
+    return ret_str;
+}
+
+// Extracts the raw value of a top-level field from a flat JSON object. Strings are returned unquoted.
+std::optional<std::string_view> json_field(std::string_view json, std::string_view key) {
+    auto pos = json.find(FMT("\"{}\"", key));
+    if (pos == std::string_view::npos) {
+        return std::nullopt;
+    }
+    pos = json.find(':', pos + key.size() + 2);
+    if (pos == std::string_view::npos) {
+        return std::nullopt;
+    }
+    pos = json.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos == std::string_view::npos) {
+        return std::nullopt;
+    }
+    if (json[pos] == '"') {
+        auto end = json.find('"', pos + 1);
+        if (end == std::string_view::npos) {
+            return std::nullopt;
+        }
+        return json.substr(pos + 1, end - pos - 1);
+    }
+    auto end = json.find_first_of(",} \t\r\n", pos);
+    return json.substr(pos, end == std::string_view::npos ? end : end - pos);
+}
+
+std::optional<int> json_int_field(std::string_view json, std::string_view key) {
+    auto value = json_field(json, key);
+    if (!value) {
+        return std::nullopt;
+    }
+    std::string str(*value);
+    char *end = nullptr;
+    long ret = strtol(str.c_str(), &end, 10);
+    if (str.empty() || *end) {
+        return std::nullopt;
+    }
+    return (int)ret;
+}
+
+void track_device(Device &d);
+
+std::string find_device(Device &d) {
+    for (auto &adapter : g.adapters) {
+        bool found = false;
+        introspect("org.bluez", adapter.path.c_str(), [&](IntrospectionScanner::Kind kind, std::string_view node){
+            if (kind != IntrospectionScanner::Node) {
+                return true;
+            }
+            auto node_path = AFMT("{}/{}", adapter.path, node);
+            auto addr = get_string_property(node_path.c_str(), "org.bluez.Device1", "Address");
+            if (addr != d.config->addr) {
+                return true;
+            }
+            d.adapter = adapter.name;
+            if (std::string_view(node_path) != d.device_path) {
+                d.device_path = node_path;
+                track_device(d);
+            }
+            g.metrics.mark(Device_found);
+            found = true;
+            return false;
+        });
+        if (found) {
+            return d.device_path;
+        }
+    }
+    for (auto &adapter : g.adapters) {
+        request_discovery(adapter);
+    }
+    return "";
+}
+
+void release_write(Device &d);
+
+void account_link_down(Device &d) {
+    if (d.connected_since.time_since_epoch().count()) {
+        g.metrics.connected_time += to_us(std::chrono::steady_clock::now() - d.connected_since);
+        d.connected_since = {};
+    }
+}
+
+// Forgets the session state of a link that went down
+void link_down(Device &d) {
+    account_link_down(d);
+    release_write(d);
+    d.device_state = DeviceState{};
+    d.update_state(Disconnected);
+    clear_requests(d);
+    d.link_generation++;
+}
+
+void finish_resolve(Device &d, int r) {
+    if (d.resolve_source) {
+        sd_event_source_set_enabled(d.resolve_source, SD_EVENT_OFF);
+    }
+    auto waiters = std::move(d.resolve_waiters);
+    d.resolve_waiters.clear();
+    for (auto &[waiter, result] : waiters) {
+        *result = r;
+        waiter.resume();
+    }
+}
+
+// Applies an a{sv} of Device1 properties, as carried by both GetAll replies and PropertiesChanged
+void read_device_properties(Device &d, sd_bus_message *m) {
+    bool was_connected = d.link.connected;
+    bool was_resolved = d.link.services_resolved;
+    if (sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sv}") < 0) {
+        return;
+    }
+    while (sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "sv") > 0) {
+        const char *name = nullptr;
+        sd_bus_message_read(m, "s", &name);
+        std::string_view member = name ? name : "";
+        int flag = 0;
+        int16_t rssi = 0;
+        if (member == "Connected" && sd_bus_message_read(m, "v", "b", &flag) >= 0) {
+            d.link.connected = flag;
+        } else if (member == "ServicesResolved" && sd_bus_message_read(m, "v", "b", &flag) >= 0) {
+            d.link.services_resolved = flag;
+        } else if (member == "Paired" && sd_bus_message_read(m, "v", "b", &flag) >= 0) {
+            d.link.paired = flag;
+        } else if (member == "RSSI" && sd_bus_message_read(m, "v", "n", &rssi) >= 0) {
+            d.rssi = rssi;
+            d.rssi_at = std::chrono::steady_clock::now();
+        } else {
+            sd_bus_message_skip(m, "v");
+        }
+        sd_bus_message_exit_container(m);
+    }
+    sd_bus_message_exit_container(m);
+
+    if (was_connected && !d.link.connected) {
+        LOG("Link to {} went down", d.config->addr);
+        d.link.services_resolved = false;
+        if (d.device_state.state >= Connected) {
+            link_down(d);
+        }
+        finish_resolve(d, -ECONNRESET);
+    } else if (!was_resolved && d.link.services_resolved) {
+        finish_resolve(d, 0);
+    }
+}
+
+int on_device_properties(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    (void)ret_error;
+    const char *interface = nullptr;
+    if (sd_bus_message_read(m, "s", &interface) < 0 || strcmp(interface, "org.bluez.Device1") != 0) {
+        return 0;
+    }
+    read_device_properties(*(Device *)userdata, m);
+    return 0;
+}
+
+void untrack_device(Device &d) {
+    d.props_slot = sd_bus_slot_unref(d.props_slot);
+    d.link = LinkProperties{};
+}
+
+// Subscribes to property changes of the device object and seeds the cache with a single GetAll, so the
+// polling path never reads properties
+void track_device(Device &d) {
+    untrack_device(d);
+    int r = sd_bus_match_signal(g.bus, &d.props_slot, "org.bluez", d.device_path.c_str(),
+                                "org.freedesktop.DBus.Properties", "PropertiesChanged", on_device_properties, &d);
+    if (r < 0) {
+        LOG("Can't watch properties of {}: {}", d.config->addr, strerror(-r));
+    }
+    sd_bus_message *reply = nullptr;
+    sd_bus_error e = SD_BUS_ERROR_NULL;
+    r = sd_bus_call_method(g.bus, "org.bluez", d.device_path.c_str(),
+                           "org.freedesktop.DBus.Properties", "GetAll", &e, &reply, "s", "org.bluez.Device1");
+    if (r < 0) {
+        LOG("Can't read properties of {}: {}", d.config->addr, e.message ? e.message : strerror(-r));
+        sd_bus_error_free(&e);
+        return;
+    }
+    read_device_properties(d, reply);
+    sd_bus_message_unref(reply);
+}
+
+// Waits until BlueZ has resolved the GATT services of the connected device
+struct ServicesResolved {
+    Device &d;
+    int r = 0;
+
+    bool await_ready() {
+        return d.link.services_resolved;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        bool first = d.resolve_waiters.empty();
+        d.resolve_waiters.emplace_back(h, &r);
+        if (!first) {
+            return;
+        }
+        if (!d.resolve_source) {
+            sd_event_add_time_relative(g.event, &d.resolve_source, CLOCK_MONOTONIC,
+                                       to_us(SERVICES_RESOLVE_TIMEOUT).count(), 0,
+                                       [](sd_event_source *s, uint64_t usec, void *userdata){
+                finish_resolve(*(Device *)userdata, -ETIMEDOUT);
+                return 0;
+            }, &d);
+            return;
+        }
+        sd_event_source_set_time_relative(d.resolve_source, to_us(SERVICES_RESOLVE_TIMEOUT).count());
+        sd_event_source_set_enabled(d.resolve_source, SD_EVENT_ONESHOT);
+    }
+
+    int await_resume() {
+        return r;
+    }
+};
+
+// Connect is awaited without blocking the loop, a slow or failing connection doesn't delay other devices
+Task connect(Device &d) {
+    if (d.link.connected) {
+        co_return 0;
+    }
+    link_down(d);
+
+    sd_bus_message *m = nullptr;
+    LOG("Connecting to {}...", d.config->addr);
+    int r = sd_bus_message_new_method_call(g.bus, &m, "org.bluez", d.device_path.c_str(), "org.bluez.Device1", "Connect");
+    if (r < 0) {
+        co_return r;
+    }
+    begin_request(d);
+    r = co_await BusCall{m, 0};
+    end_request(d);
+    if (r >= 0) {
+        LOG("Connected");
+        // PropertiesChanged follows, don't wait for it
+        d.link.connected = true;
+        d.connected_since = std::chrono::steady_clock::now();
+        g.metrics.connections++;
+        d.update_state(Connected);
+    } else {
+        LOG("Can't connect: {}", strerror(-r));
+        // The cached path may be stale, look the device up again next time
+        d.device_path.clear();
+        untrack_device(d);
+    }
+    co_return r < 0 ? r : 0;
+}
+
+void release_write(Device &d) {
+    if (d.write_fd >= 0) {
+        close(d.write_fd);
+        d.write_fd = -1;
+    }
+}
+
+// Acquires a socket for writing the TX characteristic without going through D-Bus for every frame.
+// Older BlueZ versions don't support it, frames are then sent with WriteValue.
+void acquire_write(Device &d) {
+    if (d.write_fd >= 0) {
+        return;
+    }
+    sd_bus_message *reply = nullptr;
+    sd_bus_error e = SD_BUS_ERROR_NULL;
+    int r = sd_bus_call_method(g.bus, "org.bluez", d.tx_path.c_str(),
+                               "org.bluez.GattCharacteristic1", "AcquireWrite", &e, &reply, "a{sv}", 0);
+    if (r < 0) {
+        LOG("Can't acquire TX socket, using WriteValue: {}", e.message ? e.message : strerror(-r));
+        sd_bus_error_free(&e);
+        return;
+    }
+    int fd = -1;
+    uint16_t mtu = 0;
+    r = sd_bus_message_read(reply, "hq", &fd, &mtu);
+    if (r >= 0) {
+        // The reply owns its descriptor
+        d.write_fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        d.write_mtu = mtu;
+        LOG("Acquired TX socket, MTU {}", mtu);
+    }
+    sd_bus_message_unref(reply);
+}
+
+void disconnect(Device &d) {
+    release_write(d);
+    {
+        sd_bus_message *reply = nullptr;
+        sd_bus_error e = SD_BUS_ERROR_NULL;
+        LOG("Stopping notify on RX");
+        int r = sd_bus_call_method(g.bus, "org.bluez", d.rx_path.c_str(),
+                                 "org.bluez.GattCharacteristic1", "StopNotify",
+                                 &e, &reply, "");
+        if (r >= 0) {
+            LOG("Stopped notify on RX");
+            sd_bus_message_unref(reply);
+        } else {
+            LOG("Can't stop notify on RX");
+        }
+    }
+    sd_bus_message *reply = nullptr;
+    sd_bus_error e = SD_BUS_ERROR_NULL;
+    LOG("Disconnecting {}...", d.config->addr);
+    int r = sd_bus_call_method(g.bus, "org.bluez", d.device_path.c_str(),
+                               "org.bluez.Device1", "Disconnect", &e, &reply, "");
+    if (r >= 0) {
+        LOG("Disconnected");
+        account_link_down(d);
+        sd_bus_message_unref(reply);
+    } else {
+        LOG("Can't disconnect");
+    }
+}
+
+std::string friendly(std::string_view sv) {
+    std::string s(sv);
+    std::replace(s.begin(), s.end(), '_', ' ');
+    return s;
+}
+
+// Inverse of friendly(): matches enum names case-insensitively, with spaces in place of underscores
+template <typename E>
+std::optional<E> from_friendly(std::string_view sv) {
+    return magic_enum::enum_cast<E>(sv, [](char a, char b){
+        return tolower(a == ' ' ? '_' : a) == tolower(b);
+    });
+}
+
+std::string DeviceState::to_json(std::optional<std::chrono::system_clock::time_point> stale_since) {
+    return fmt::format("{{ \"state\": {}, "
+                       "\"program\": {}, "
+                       "\"temperature\": {}, "
+                       "\"hours\": {}, "
+                       "\"minutes\": {}{}}}",
+                       std::quoted(friendly(magic_enum::enum_name(state))),
+                       std::quoted(friendly(magic_enum::enum_name(program))),
+                       temperature,
+                       hours,
+                       minutes,
+                       stale_since ? FMT(", \"stale_since\": {}", std::chrono::system_clock::to_time_t(*stale_since)) : "");
+}
+
+bool same_reading(const DeviceState &a, const DeviceState &b) {
+    return a.state == b.state && a.program == b.program && a.temperature == b.temperature &&
+           a.hours == b.hours && a.minutes == b.minutes;
+}
+
+// Replaces the file with `data` through a temporary file, so readers see either the old or the new content
+bool write_file_atomically(const std::string &path, std::string_view data, mode_t mode = 0644) {
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd < 0) {
+        LOG("Can't write {}: {}", tmp, strerror(errno));
+        return false;
+    }
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        LOG("Can't write {}: {}", path, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Writes the decoded state atomically over the checkpoint. The checkpoint is the state as it would be
+// published once stale.
+void checkpoint_state(Device &d) {
+    auto now = std::chrono::system_clock::now();
+    if (same_reading(d.saved, d.device_state) && now - d.saved_at < STATE_CHECKPOINT_INTERVAL) {
+        return;
+    }
+    d.saved = d.device_state;
+    d.saved_at = now;
+    write_file_atomically(d.state_file, d.device_state.to_json(now));
+}
+
+bool owns_lease(const Device &d);
+
+void restore_state(Device &d) {
+    char buf[512];
+    int fd = open(d.state_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    std::string_view json(buf, std::max<ssize_t>(n, 0));
+    auto state = json_field(json, "state");
+    auto program = json_field(json, "program");
+    auto temperature = json_int_field(json, "temperature");
+    auto hours = json_int_field(json, "hours");
+    auto minutes = json_int_field(json, "minutes");
+    auto saved_at = json_int_field(json, "stale_since");
+    auto state_value = state ? from_friendly<State>(*state) : std::nullopt;
+    auto program_value = program ? from_friendly<Program>(*program) : std::nullopt;
+    if (!state_value || *state_value < Off || !program_value || !temperature || !hours || !minutes || !saved_at) {
+        LOG("Ignoring malformed {}", d.state_file);
+        return;
+    }
+    d.restored = DeviceState{0, *program_value, *state_value, *temperature, *hours, *minutes};
+    d.saved = *d.restored;
+    d.saved_at = std::chrono::system_clock::from_time_t(*saved_at);
+    LOG("Restored state of {}: {}", d.config->addr, json);
+    sd_event_add_time_relative(g.event, &d.stale_source, CLOCK_MONOTONIC, to_us(RESTORED_STATE_GRACE).count(), 0,
+                               [](sd_event_source *s, uint64_t usec, void *userdata){
+        auto &d = *(Device *)userdata;
+        // Only the owner speaks for the device, another instance's live state must not be overwritten
+        if (d.restored && owns_lease(d)) {
+            LOG("Restored state of {} wasn't confirmed, republishing it as stale", d.config->addr);
+            d.restored_stale = true;
+            d.publish();
+        }
+        return 0;
+    }, &d);
+}
+
+History::~History() {
+    if (header) {
+        munmap(header, size);
+    }
+}
+
+bool History::open(const std::string &path) {
+    size = sizeof(HistoryHeader) + HISTORY_CAPACITY * sizeof(HistoryRecord);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG("Can't open history {}: {}", path, strerror(errno));
+        return false;
+    }
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        LOG("Can't map history {}: {}", path, strerror(errno));
+        return false;
+    }
+    header = (HistoryHeader *)p;
+    records = (HistoryRecord *)(header + 1);
+    if (header->magic != MAGIC || header->record_size != sizeof(HistoryRecord) ||
+        header->capacity != HISTORY_CAPACITY) {
+        LOG("Starting new history in {}", path);
+        *header = HistoryHeader{MAGIC, sizeof(HistoryRecord), HISTORY_CAPACITY, 0, 0, {}};
+    }
+    // Files written before tail was kept have it zeroed
+    if (header->tail > header->head || header->head - header->tail > HISTORY_CAPACITY) {
+        header->tail = header->head > HISTORY_CAPACITY ? header->head - HISTORY_CAPACITY : 0;
+    }
+    return true;
+}
+
+void History::append(const DeviceState &state) {
+    if (!header) {
+        return;
+    }
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    uint64_t head = header->head;
+    int64_t time_ms = now.count();
+    if (head > header->tail) {
+        time_ms = std::max(time_ms, at(head - 1).time_ms);
+    }
+    if (head - header->tail == HISTORY_CAPACITY) {
+        std::atomic_ref<uint64_t>(header->tail).store(header->tail + 1, std::memory_order_release);
+    }
+    records[head % HISTORY_CAPACITY] = HistoryRecord{time_ms, (int8_t)state.state, (uint8_t)state.program,
+                                                      (uint8_t)state.temperature, (uint8_t)state.hours,
+                                                      (uint8_t)state.minutes, {}};
+    std::atomic_ref<uint64_t>(header->head).store(head + 1, std::memory_order_release);
+}
+
+uint64_t History::begin() const {
+    return header ? header->tail : 0;
+}
+
+uint64_t History::end() const {
+    return header ? header->head : 0;
+}
+
+const HistoryRecord &History::at(uint64_t index) const {
+    return records[index % HISTORY_CAPACITY];
+}
+
+uint64_t History::lower_bound(int64_t time_ms) const {
+    uint64_t lo = begin();
+    uint64_t hi = end();
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (at(mid).time_ms < time_ms) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Appends an unsigned LEB128 varint
+size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+// Streams history records in [from, to) straight from the ring as packed chunks of at most
+// HISTORY_EXPORT_CHUNK bytes. Every chunk decodes on its own:
+//   u8 flags (version 1 in the low bits, 0x80 on the last chunk), varint sequence number,
+//   varint request id length and bytes, varint base time (Unix ms), then records until the end:
+//   varint (time delta << 1 | changed), [u8 state, u8 program if changed], zigzag varint temperature delta,
+//   zigzag varint delta of the remaining time in minutes.
+// Deltas are against the previous record of the chunk, the first one against the base time and zeroes.
+// State and program are run-length coded: a record only carries them when they change.
+void export_history(const Device &d, int64_t from, int64_t to, std::string_view requester) {
+    static constexpr uint8_t VERSION = 1;
+    static constexpr uint8_t LAST = 0x80;
+    static constexpr size_t MAX_RECORD = 10 + 2 + 10 + 10;
+    auto start = std::chrono::steady_clock::now();
+    requester = requester.substr(0, 64);
+    uint8_t chunk[HISTORY_EXPORT_CHUNK];
+    size_t len = 0;
+    uint64_t seq = 0;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    const HistoryRecord *prev = nullptr;
+    int64_t prev_time = 0;
+
+    auto begin_chunk = [&](int64_t base) {
+        chunk[0] = VERSION;
+        len = 1;
+        len += put_varint(chunk + len, seq++);
+        len += put_varint(chunk + len, requester.size());
+        memcpy(chunk + len, requester.data(), requester.size());
+        len += requester.size();
+        len += put_varint(chunk + len, base);
+        prev = nullptr;
+        prev_time = base;
+    };
+    auto flush_chunk = [&](bool last) {
+        int mid = -1;
+        chunk[0] |= last ? LAST : 0;
+        mosquitto_publish(g.mqtt, &mid, M223S_HISTORY_EXPORT_TOPIC, len, chunk, 1, false);
+        bytes += len;
+    };
+
+    uint64_t i = d.history.lower_bound(from);
+    begin_chunk(i < d.history.end() ? d.history.at(i).time_ms : from);
+    for (; i < d.history.end() && d.history.at(i).time_ms < to; i++) {
+        auto &r = d.history.at(i);
+        if (len + MAX_RECORD > sizeof(chunk)) {
+            flush_chunk(false);
+            begin_chunk(r.time_ms);
+        }
+        bool changed = !prev || r.state != prev->state || r.program != prev->program;
+        len += put_varint(chunk + len, (uint64_t)(r.time_ms - prev_time) << 1 | changed);
+        if (changed) {
+            chunk[len++] = (uint8_t)r.state;
+            chunk[len++] = r.program;
+        }
+        len += put_varint(chunk + len, zigzag((int)r.temperature - (prev ? prev->temperature : 0)));
+        int timer = r.hours * 60 + r.minutes;
+        len += put_varint(chunk + len, zigzag(timer - (prev ? prev->hours * 60 + prev->minutes : 0)));
+        prev = &r;
+        prev_time = r.time_ms;
+        records++;
+    }
+    flush_chunk(true);
+    g.metrics.history_packed.add(records, bytes, to_us(std::chrono::steady_clock::now() - start));
+}
+
+std::string CookingSession::to_json(const Device &d) {
+    std::string states;
+    for (auto state : {Delayed, Heating, On}) {
+        states += FMT("{}{}: {:.0f}", states.empty() ? "" : ", ", std::quoted(friendly(magic_enum::enum_name(state))),
+                      time_in_state[*magic_enum::enum_index(state)].count() / 1000.0);
+    }
+    std::string heating_rate = "null";
+    if (heating_start && heating_last.first > heating_start->first) {
+        auto minutes = std::chrono::duration<double, std::ratio<60>>(heating_last.first - heating_start->first).count();
+        heating_rate = FMT("{:.2f}", (heating_last.second - heating_start->second) / minutes);
+    }
+    auto end = std::chrono::system_clock::now();
+    return FMT("{{ \"device\": {}, \"program\": {}, \"start\": {}, \"end\": {}, \"duration_s\": {}, "
+               "\"time_in_state_s\": {{ {}}}, \"peak_temperature\": {}, \"heating_rate_per_min\": {}}}",
+               std::quoted(d.config->addr),
+               std::quoted(friendly(magic_enum::enum_name(program))),
+               std::chrono::system_clock::to_time_t(start),
+               std::chrono::system_clock::to_time_t(end),
+               std::chrono::duration_cast<std::chrono::seconds>(end - start).count(),
+               states,
+               peak_temperature,
+               heating_rate);
+}
+
+// Feeds a decoded status into the session aggregates and publishes the summary when the session ends
+void track_session(Device &d) {
+    auto &s = d.session;
+    auto &state = d.device_state;
+    auto now = std::chrono::steady_clock::now();
+    if (!magic_enum::enum_contains(state.state) || state.state == Unknown) {
+        return;
+    }
+    bool cooking = state.state == Delayed || state.state == Heating || state.state == On;
+    if (!s.active) {
+        if (!cooking) {
+            return;
+        }
+        s = CookingSession{};
+        s.active = true;
+        s.start = std::chrono::system_clock::now();
+        s.last_sample = now;
+        s.last_state = state.state;
+        LOG("Session on {} started", d.config->addr);
+    }
+    s.time_in_state[*magic_enum::enum_index(s.last_state)] +=
+            std::chrono::duration_cast<std::chrono::milliseconds>(now - s.last_sample);
+    s.last_sample = now;
+    s.last_state = state.state;
+    s.program = state.program;
+    s.peak_temperature = std::max(s.peak_temperature, state.temperature);
+    if (state.state == Heating) {
+        if (!s.heating_start) {
+            s.heating_start.emplace(now, state.temperature);
+        }
+        s.heating_last = {now, state.temperature};
+    }
+    if (state.state == Keep_warm || state.state == Off) {
+        int mid = -1;
+        std::string session_json = s.to_json(d);
+        LOG("Session on {} ended: {}", d.config->addr, session_json);
+        mosquitto_publish(g.mqtt, &mid, M223S_SESSION_TOPIC, session_json.size(), session_json.data(), 1, false);
+        s.active = false;
+    }
+}
+
+// The device with the given address, the first one still configured if no address is given
+Device *lookup_device(std::optional<std::string_view> addr) {
+    auto it = std::find_if(g.devices.begin(), g.devices.end(), [&](auto &d){
+        return !d->removed && (!addr || d->config->addr == *addr);
+    });
+    return it != g.devices.end() ? it->get() : nullptr;
+}
+
+// Replies with the records of a device between "from" and "to" (Unix seconds, to is exclusive), oldest first
+void on_history_query(std::string_view payload) {
+    auto addr = json_field(payload, "device");
+    Device *d = lookup_device(addr);
+    if (d && !owns_lease(*d)) {
+        // Answered by the owner
+        return;
+    }
+    std::string requester(json_field(payload, "id").value_or(""));
+    std::string request_id = requester.empty() ? "" : FMT(", \"request_id\": {}", std::quoted(requester));
+    int mid = -1;
+    if (!d) {
+        std::string result_json = FMT("{{ \"device\": {}, \"error\": \"unknown device\"{}}}",
+                                      std::quoted(*addr), request_id);
+        mosquitto_publish(g.mqtt, &mid, M223S_HISTORY_RESULT_TOPIC, result_json.size(), result_json.data(), false, false);
+        return;
+    }
+    int64_t from = json_int_field(payload, "from").value_or(0) * 1000ll;
+    int64_t to = json_int_field(payload, "to").value_or(INT32_MAX) * 1000ll;
+    if (json_field(payload, "format") == "packed") {
+        export_history(*d, from, to, requester);
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    size_t limit = std::min<size_t>(json_int_field(payload, "limit").value_or(HISTORY_QUERY_LIMIT), HISTORY_QUERY_LIMIT);
+    std::string records;
+    uint64_t i = d->history.lower_bound(from);
+    for (size_t n = 0; i < d->history.end() && n < limit && d->history.at(i).time_ms < to; i++, n++) {
+        auto &r = d->history.at(i);
+        records += FMT("{}{{ \"time_ms\": {}, \"state\": {}, \"program\": {}, \"temperature\": {}, \"hours\": {}, "
+                       "\"minutes\": {}}}",
+                       records.empty() ? "" : ", ",
+                       r.time_ms,
+                       std::quoted(friendly(magic_enum::enum_name((State)r.state))),
+                       std::quoted(friendly(magic_enum::enum_name((Program)r.program))),
+                       r.temperature,
+                       r.hours,
+                       r.minutes);
+    }
+    bool more = i < d->history.end() && d->history.at(i).time_ms < to;
+    std::string result_json = FMT("{{ \"device\": {}, \"records\": [{}], \"more\": {}{}}}",
+                                  std::quoted(d->config->addr), records, more, request_id);
+    mosquitto_publish(g.mqtt, &mid, M223S_HISTORY_RESULT_TOPIC, result_json.size(), result_json.data(), false, false);
+    g.metrics.history_json.add(i - d->history.lower_bound(from), result_json.size(),
+                               to_us(std::chrono::steady_clock::now() - start));
+}
+
+std::string_view trim(std::string_view sv) {
+    auto begin = sv.find_first_not_of(" \t");
+    if (begin == std::string_view::npos) {
+        return {};
+    }
+    return sv.substr(begin, sv.find_last_not_of(" \t") + 1 - begin);
+}
+
+std::optional<int> parse_int(std::string_view sv) {
+    int value = 0;
+    auto [end, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), value);
+    if (ec != std::errc() || end != sv.data() + sv.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::optional<RuleCondition> compile_condition(std::string_view src) {
+    static constexpr std::pair<std::string_view, RuleField> FIELDS[] = {
+        {"state", Field_state},
+        {"program", Field_program},
+        {"temperature", Field_temperature},
+        {"time_left", Field_time_left},
+    };
+    // Two-character ops first, so that "<=" isn't taken for "<"
+    static constexpr std::pair<std::string_view, RuleOp> OPS[] = {
+        {"==", Op_eq}, {"!=", Op_ne}, {"<=", Op_le}, {">=", Op_ge}, {"<", Op_lt}, {">", Op_gt},
+    };
+    for (auto &[op_name, op] : OPS) {
+        auto pos = src.find(op_name);
+        if (pos == std::string_view::npos) {
+            continue;
+        }
+        auto field_name = trim(src.substr(0, pos));
+        auto value = trim(src.substr(pos + op_name.size()));
+        auto field = std::find_if(std::begin(FIELDS), std::end(FIELDS), [&](auto &f){ return f.first == field_name; });
+        if (field == std::end(FIELDS)) {
+            return std::nullopt;
+        }
+        std::optional<int> v;
+        if (field->second == Field_state) {
+            v = from_friendly<State>(value);
+        } else if (field->second == Field_program) {
+            v = from_friendly<Program>(value);
+        } else {
+            v = parse_int(value);
+        }
+        if (!v) {
+            return std::nullopt;
+        }
+        return RuleCondition{field->second, op, *v};
+    }
+    return std::nullopt;
+}
+
+std::optional<std::chrono::milliseconds> parse_duration(std::string_view src) {
+    static constexpr std::pair<std::string_view, std::chrono::milliseconds> UNITS[] = {
+        {"min", 1min}, {"ms", 1ms}, {"s", 1s}, {"h", 1h},
+    };
+    for (auto &[unit, scale] : UNITS) {
+        if (src.size() > unit.size() && src.substr(src.size() - unit.size()) == unit) {
+            auto n = parse_int(trim(src.substr(0, src.size() - unit.size())));
+            if (n && *n >= 0) {
+                return *n * scale;
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+// Parses a rule and appends it to the flat rule and condition tables
+bool compile_rule(std::string_view src) {
+    auto arrow = src.find("->");
+    if (arrow == std::string_view::npos) {
+        return false;
+    }
+    Rule rule;
+    rule.source = src;
+    auto action = from_friendly<CommandKind>(trim(src.substr(arrow + 2)));
+    // Start needs settings a rule doesn't carry
+    if (!action || *action == Start) {
+        return false;
+    }
+    rule.action = *action;
+    auto conditions = src.substr(0, arrow);
+    if (auto pos = conditions.rfind(" for "); pos != std::string_view::npos) {
+        auto hold = parse_duration(trim(conditions.substr(pos + 5)));
+        if (!hold) {
+            return false;
+        }
+        rule.hold = *hold;
+        conditions = conditions.substr(0, pos);
+    }
+    rule.first_condition = g.rule_conditions.size();
+    while (!conditions.empty()) {
+        auto pos = conditions.find(" and ");
+        auto condition = compile_condition(conditions.substr(0, pos));
+        if (!condition) {
+            g.rule_conditions.resize(rule.first_condition);
+            return false;
+        }
+        g.rule_conditions.push_back(*condition);
+        conditions = pos == std::string_view::npos ? std::string_view{} : conditions.substr(pos + 5);
+    }
+    rule.conditions = g.rule_conditions.size() - rule.first_condition;
+    g.rules.push_back(rule);
+    return true;
+}
+
+void compile_rules() {
+    for (auto src : RULES) {
+        if (!compile_rule(src)) {
+            LOG("Ignoring invalid rule: {}", src);
+        }
+    }
+    for (auto &d : g.devices) {
+        d->rule_states.assign(g.rules.size(), RuleState{});
+    }
+    LOG("Compiled {} rules", g.rules.size());
+}
+
+bool matches(const RuleCondition &c, const DeviceState &state) {
+    int value = 0;
+    switch (c.field) {
+    case Field_state: value = state.state; break;
+    case Field_program: value = state.program; break;
+    case Field_temperature: value = state.temperature; break;
+    case Field_time_left: value = state.hours * 60 + state.minutes; break;
+    }
+    switch (c.op) {
+    case Op_eq: return value == c.value;
+    case Op_ne: return value != c.value;
+    case Op_lt: return value < c.value;
+    case Op_le: return value <= c.value;
+    case Op_gt: return value > c.value;
+    case Op_ge: return value >= c.value;
+    }
+    return false;
+}
+
+void enqueue_command(Device &d, Command c);
+
+// Runs the rules over the current cooker state. Only cooker states are evaluated, the link state says
+// nothing about the cooker and mustn't reset a rule that is counting.
+void evaluate_rules(Device &d) {
+    if (d.device_state.state < Off) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < g.rules.size(); i++) {
+        auto &rule = g.rules[i];
+        auto &state = d.rule_states[i];
+        bool holds = true;
+        for (uint32_t c = rule.first_condition; holds && c < rule.first_condition + rule.conditions; c++) {
+            holds = matches(g.rule_conditions[c], d.device_state);
+        }
+        if (!holds) {
+            state = RuleState{};
+            continue;
+        }
+        if (!state.holding) {
+            state.holding = true;
+            state.held_since = now;
+        }
+        if (state.fired || now - state.held_since < rule.hold) {
+            continue;
+        }
+        state.fired = true;
+        LOG("Rule {} fired on {}: {}", i, d.config->addr, rule.source);
+        enqueue_command(d, Command{rule.action, Normal, now, now + COMMAND_TTL, 0, {FMT("rule-{}", i)}});
+    }
+}
+
+void Device::update_state(State state_) {
+    device_state.state = state_;
+    evaluate_rules(*this);
+    // The restored state stands until the device reports again, link state alone would contradict it
+    if (restored) {
+        return;
+    }
+    // Link state is expected to flap with on-demand connections, only the cooker state is of interest
+    if (LINK_POLICY == Always_connected || state_ >= Off) {
+        publish();
+    }
+}
+
+void Device::update_state(State state_, Program program_, int temperature_, int hours_, int minutes_) {
+    device_state.state = state_;
+    device_state.program = program_;
+    device_state.temperature = temperature_;
+    device_state.hours = hours_;
+    device_state.minutes = minutes_;
+    evaluate_rules(*this);
+    if (restored) {
+        // Subscribers already have the restored state retained, unless it went out as stale
+        bool confirmed = !restored_stale && same_reading(*restored, device_state);
+        restored.reset();
+        if (stale_source) {
+            sd_event_source_set_enabled(stale_source, SD_EVENT_OFF);
+        }
+        if (confirmed) {
+            return;
+        }
+    }
+    publish();
+    checkpoint_state(*this);
+}
+
+void Device::publish() {
+    int mid = -1;
+    // A restored state is only published once it's stale
+    std::string state_json = restored ? restored->to_json(saved_at) : device_state.to_json();
+    int r = mosquitto_publish(g.mqtt, &mid, config->state_topic, state_json.size(), state_json.data(), true, false);
+    if (r == MOSQ_ERR_SUCCESS && g.mqtt_connected) {
+        g.metrics.mark(State_published);
+    }
+}
+
+void LatencyStats::add(std::chrono::microseconds latency) {
+    count++;
+    total += latency;
+    max = std::max(max, latency);
+}
+
+void ExportStats::add(uint64_t records_, uint64_t bytes_, std::chrono::microseconds time_) {
+    records += records_;
+    bytes += bytes_;
+    time.add(time_);
+}
+
+std::string ExportStats::to_json() {
+    return fmt::format("{{ \"records\": {}, \"bytes\": {}, \"bytes_per_record\": {:.2f}, \"records_per_s\": {:.0f}, "
+                       "\"time\": {}}}",
+                       records,
+                       bytes,
+                       records ? (double)bytes / records : 0.0,
+                       time.total.count() ? records * 1e6 / time.total.count() : 0.0,
+                       time.to_json());
+}
+
+std::string LatencyStats::to_json() {
+    return fmt::format("{{ \"count\": {}, \"avg_ms\": {:.3f}, \"max_ms\": {:.3f}}}",
+                       count,
+                       count ? total.count() / 1000.0 / count : 0.0,
+                       max.count() / 1000.0);
+}
+
+void Metrics::mark(StartupPhase phase) {
+    if (startup[phase]) {
+        return;
+    }
+    startup[phase] = to_us(std::chrono::steady_clock::now() - start_time);
+    LOG("Startup: {} after {:.1f} ms", friendly(magic_enum::enum_name(phase)), startup[phase]->count() / 1000.0);
+}
+
+void Metrics::publish() {
+    int mid = -1;
+    auto now = std::chrono::steady_clock::now();
+    auto link_time = connected_time;
+    for (auto &d : g.devices) {
+        if (d->connected_since.time_since_epoch().count()) {
+            link_time += to_us(now - d->connected_since);
+        }
+    }
+    double duty_cycle = (double)link_time.count() / to_us(now - start_time).count() / std::max<size_t>(g.devices.size(), 1);
+    std::string startup_json;
+    for (auto phase : magic_enum::enum_values<StartupPhase>()) {
+        startup_json += FMT("{}\"{}_ms\": ", startup_json.empty() ? "" : ", ", magic_enum::enum_name(phase));
+        startup_json += startup[phase] ? FMT("{:.1f}", startup[phase]->count() / 1000.0) : "null";
+    }
+    std::string metrics_json = fmt::format("{{ \"startup\": {{ {}}}, "
+                                           "\"command_latency\": {{ \"idle\": {}, \"scanning\": {}}}, "
+                                           "\"link\": {{ \"policy\": {}, \"connections\": {}, \"duty_cycle\": {:.3f}, "
+                                           "\"session_setup\": {}, \"command\": {}, \"start\": {}}}, "
+                                           "\"commands\": {{ \"merged\": {}}}, \"introspection\": {}, "
+                                           "\"gatt\": {{ \"resolve\": {}, \"calls\": {}, \"cancelled\": {}}}, "
+                                           "\"history\": {{ \"json\": {}, \"packed\": {}}}, "
+                                           "\"schedule\": {{ \"jobs\": {}, \"jitter\": {}}}, "
+                                           "\"reload\": {{ \"time\": {}, \"reconnects\": {}}}, "
+                                           "\"dispatch\": {{ \"commands\": {}, \"state\": {}, \"housekeeping\": {}}}, "
+                                           "\"tx\": {{ \"delayed\": {}, \"rejected\": {}, \"marshal_fd\": {}, \"marshal_dbus\": {}}}, "
+                                           "\"coroutines\": {{ \"workflows\": {}, \"frames\": {}, \"heap_allocations\": {}}}, "
+                                           "\"heap\": {{ \"dispatches\": {}, \"allocations_per_dispatch\": {:.2f}, "
+                                           "\"arena_overflows\": {}}}}}",
+                                           startup_json,
+                                           latency_idle.to_json(),
+                                           latency_scanning.to_json(),
+                                           std::quoted(friendly(magic_enum::enum_name(LINK_POLICY))),
+                                           connections,
+                                           duty_cycle,
+                                           session_setup.to_json(),
+                                           command.to_json(),
+                                           start.to_json(),
+                                           merged_commands,
+                                           introspection.to_json(),
+                                           gatt_resolve.to_json(),
+                                           gatt_calls,
+                                           gatt_cancelled,
+                                           history_json.to_json(),
+                                           history_packed.to_json(),
+                                           g.jobs.size(),
+                                           schedule_jitter.to_json(),
+                                           reload.to_json(),
+                                           reload_reconnects,
+                                           dispatch_commands.to_json(),
+                                           dispatch_state.to_json(),
+                                           dispatch_housekeeping.to_json(),
+                                           delayed_writes,
+                                           rejected_writes,
+                                           marshal_fd.to_json(),
+                                           marshal_dbus.to_json(),
+                                           workflows,
+                                           g.frame_pool.frames,
+                                           g.frame_pool.heap_allocations,
+                                           dispatches,
+                                           (double)heap_allocation_count / std::max<uint64_t>(dispatches, 1),
+                                           g.arena_upstream.allocations);
+    mosquitto_publish(g.mqtt, &mid, M223S_METRICS_TOPIC, metrics_json.size(), metrics_json.data(), false, false);
+}
+
+void disconnect_if_idle(Device &d);
+
+// Postpones the idle disconnect of an on-demand link
+void touch_link(Device &d) {
+    if (LINK_POLICY != On_demand) {
+        return;
+    }
+    if (!d.idle_source) {
+        sd_event_add_time_relative(g.event, &d.idle_source, CLOCK_MONOTONIC, to_us(LINK_IDLE_TIMEOUT).count(), 0,
+                                   [](sd_event_source *s, uint64_t usec, void *userdata){
+            disconnect_if_idle(*(Device *)userdata);
+            return 0;
+        }, &d);
+        return;
+    }
+    sd_event_source_set_time_relative(d.idle_source, to_us(LINK_IDLE_TIMEOUT).count());
+    sd_event_source_set_enabled(d.idle_source, SD_EVENT_ONESHOT);
+}
+
+void disconnect_if_idle(Device &d) {
+    if (!d.request_handlers.empty()) {
+        touch_link(d);
+        return;
+    }
+    LOG("Link to {} is idle", d.config->addr);
+    disconnect(d);
+}
+
+struct Status {
+    State state;
+    Program program;
+    uint8_t temperature;
+    uint8_t hours;
+    uint8_t minutes;
+};
+
+// The value has to be at least P::status.size long
+template <typename P>
+std::optional<Status> decode_status(std::span<const uint8_t> value) {
+    constexpr auto &layout = P::status;
+    uint8_t state = value[layout.state];
+    uint8_t program = value[layout.program];
+    if (state >= std::size(P::states) || program >= std::size(P::programs)) {
+        LOG("Unknown state {} or program {}", state, program);
+        return std::nullopt;
+    }
+    return Status{P::states[state], P::programs[program], value[layout.temperature], value[layout.hours],
+                  value[layout.minutes]};
+}
+
+// Returns false if the value is truncated
+template <typename P>
+bool decode_value(Device &d, std::span<const uint8_t> value) {
+    if (value[2] == P::commands.auth) {
+        d.update_state(value[3] ? Authorized : Connected);
+
+    } else if (value[2] == P::commands.query) {
+        if (value.size() < P::status.size) {
+            LOG("Value too short :(");
+            return false;
+        }
+        auto status = decode_status<P>(value);
+        if (!status) {
+            return true;
+        }
+        d.update_state(status->state, status->program, status->temperature, status->hours, status->minutes);
+        d.history.append(d.device_state);
+        track_session(d);
+    }
+    return true;
+}
+
+void on_new_value(Device &d, std::span<const uint8_t> value) {
+    if (value.size() < 4) {
+        LOG("Value too short :(");
+        return;
+    }
+    bool decoded = with_profile(d.config->model, [&]<typename P>(P) {
+        return decode_value<P>(d, value);
+    });
+    if (!decoded) {
+        return;
+    }
+    auto node = d.request_handlers.extract(value[1]);
+    if (!node.empty()) {
+        auto &req = node.mapped();
+        auto latency = to_us(std::chrono::steady_clock::now() - req.sent_time);
+        (req.during_discovery ? g.metrics.latency_scanning : g.metrics.latency_idle).add(latency);
+        end_request(d);
+        touch_link(d);
+        complete_request(d, value[1], req, 0);
+    }
+}
+
+// Each notification carries its value, reading it back with a Get could return a later one when responses
+// arrive back to back
+int on_rx_message(sd_bus_message *m, void *userdata, sd_bus_error *ret_error){
+    (void)ret_error;
+    auto &d = *(Device *)userdata;
+
+    const char *interface = nullptr;
+    if (sd_bus_message_read(m, "s", &interface) < 0 || strcmp(interface, "org.bluez.GattCharacteristic1") != 0) {
+        return 0;
+    }
+    if (sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sv}") < 0) {
+        return 0;
+    }
+    while (sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "sv") > 0) {
+        const char *name = nullptr;
+        sd_bus_message_read(m, "s", &name);
+        const void *arr = nullptr;
+        size_t len = 0;
+        if (name && strcmp(name, "Value") == 0 && sd_bus_message_enter_container(m, SD_BUS_TYPE_VARIANT, "ay") >= 0) {
+            int r = sd_bus_message_read_array(m, 'y', &arr, &len);
+            sd_bus_message_exit_container(m);
+            if (r < 0) {
+                LOG("Can't process new RX value: {}", strerror(-r));
+            } else {
+                fmt::print(stderr, "New value:");
+                for (size_t i = 0; i < len; i++) {
+                    fmt::print(stderr, " {:02x}", ((uint8_t *)arr)[i]);
+                }
+                fmt::print(stderr, "\n");
+                on_new_value(d, std::span<const uint8_t>{(const uint8_t *)arr, len});
+            }
+        } else {
+            sd_bus_message_skip(m, "v");
+        }
+        sd_bus_message_exit_container(m);
+    }
+    sd_bus_message_exit_container(m);
+    return 0;
+}
+
+// Looks up the RX and TX characteristics under the device. Nodes are introspected and characteristic UUIDs
+// read concurrently, at most GATT_RESOLVE_IN_FLIGHT calls at a time; calls still outstanding are cancelled
+// once both are found.
+struct GattResolver {
+    enum Step {
+        Introspect,
+        Get_uuid,
+    };
+
+    struct Call {
+        GattResolver *resolver;
+        Step step;
+        std::string path;
+        sd_bus_slot *slot = nullptr;
+    };
+
+    Device &d;
+    std::deque<std::pair<Step, std::string>> pending;
+    std::list<Call> calls;
+    std::coroutine_handle<> waiter;
+    std::chrono::steady_clock::time_point start;
+    bool suspended = false;
+    bool done = false;
+    int r = 0;
+
+    bool await_ready() {
+        return !d.rx_path.empty() && !d.tx_path.empty();
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        start = std::chrono::steady_clock::now();
+        pending.emplace_back(Introspect, d.device_path);
+        pump();
+        suspended = !done;
+        return suspended;
+    }
+
+    int await_resume() {
+        return r;
+    }
+
+    void pump() {
+        while (calls.size() < GATT_RESOLVE_IN_FLIGHT && !pending.empty()) {
+            auto &call = calls.emplace_back(Call{this, pending.front().first, std::move(pending.front().second)});
+            pending.pop_front();
+            int ret;
+            if (call.step == Introspect) {
+                ret = sd_bus_call_method_async(g.bus, &call.slot, "org.bluez", call.path.c_str(),
+                                               "org.freedesktop.DBus.Introspectable", "Introspect",
+                                               on_reply, &call, "");
+            } else {
+                ret = sd_bus_call_method_async(g.bus, &call.slot, "org.bluez", call.path.c_str(),
+                                               "org.freedesktop.DBus.Properties", "Get",
+                                               on_reply, &call, "ss", "org.bluez.GattCharacteristic1", "UUID");
+            }
+            if (ret < 0) {
+                LOG("Can't resolve {}: {}", call.path, strerror(-ret));
+                calls.pop_back();
+                continue;
+            }
+            g.metrics.gatt_calls++;
+        }
+        if (calls.empty()) {
+            finish(-ENOENT);
+        }
+    }
+
+    // Cancels outstanding calls and resumes the waiter, which destroys the resolver
+    void finish(int r_) {
+        r = r_;
+        done = true;
+        g.metrics.gatt_cancelled += calls.size();
+        for (auto &call : calls) {
+            sd_bus_slot_unref(call.slot);
+        }
+        calls.clear();
+        pending.clear();
+        if (r == 0) {
+            g.metrics.gatt_resolve.add(to_us(std::chrono::steady_clock::now() - start));
+        }
+        if (suspended) {
+            waiter.resume();
+        }
+    }
+
+    void on_introspect(const std::string &path, sd_bus_message *reply) {
+        const char *s = nullptr;
+        if (sd_bus_message_read(reply, "s", &s) < 0 || !s) {
+            return;
+        }
+        bool characteristic = false;
+        std::vector<std::string> children;
+        IntrospectionScanner scanner(s);
+        while (auto element = scanner.next()) {
+            if (element->kind == IntrospectionScanner::Interface) {
+                characteristic = characteristic || element->name == "org.bluez.GattCharacteristic1";
+            } else {
+                children.push_back(FMT("{}/{}", path, element->name));
+            }
+        }
+        // Only descriptors are below a characteristic
+        if (characteristic) {
+            pending.emplace_back(Get_uuid, path);
+            return;
+        }
+        for (auto &child : children) {
+            pending.emplace_back(Introspect, std::move(child));
+        }
+    }
+
+    void on_uuid(const std::string &path, sd_bus_message *reply) {
+        const char *uuid = nullptr;
+        if (sd_bus_message_read(reply, "v", "s", &uuid) < 0 || !uuid) {
+            return;
+        }
+        if (uuid == TX_UUID) {
+            d.tx_path = path;
+        } else if (uuid == RX_UUID) {
+            d.rx_path = path;
+        }
+    }
+
+    static int on_reply(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        auto *call = (Call *)userdata;
+        auto &self = *call->resolver;
+        if (sd_bus_message_is_method_error(reply, nullptr)) {
+            LOG("Can't resolve {}: {}", call->path, sd_bus_message_get_error(reply)->message);
+        } else if (call->step == Introspect) {
+            self.on_introspect(call->path, reply);
+        } else {
+            self.on_uuid(call->path, reply);
+        }
+        sd_bus_slot_unref(call->slot);
+        self.calls.remove_if([&](const Call &c){ return &c == call; });
+        if (!self.d.rx_path.empty() && !self.d.tx_path.empty()) {
+            self.finish(0);
+            return 0;
+        }
+        self.pump();
+        return 0;
+    }
+};
+
+void watch_rx(Device &d) {
+    if (!d.rx_slot) {
+        int r = sd_bus_match_signal(g.bus, &d.rx_slot, "org.bluez", d.rx_path.c_str(),
+                                    "org.freedesktop.DBus.Properties", "PropertiesChanged", on_rx_message, &d);
+        if (r >= 0) {
+            LOG("Initialized RX notify slot");
+        } else {
+            LOG("Failed to initialize RX notify slot");
+        }
+    }
+}
+
+// Request number, device index and the low bits of the link generation, so a late WriteValue error or
+// timeout of an earlier session doesn't match a request that reuses its number. Fits a 32-bit pointer.
+void *request_key(const Device &d, uint8_t req_num) {
+    return (void *)((uintptr_t)(uint8_t)d.link_generation << 24 | (uintptr_t)(d.index & 0xffff) << 8 | req_num);
+}
+
+Device &request_device(void *key) {
+    return *g.devices[(uintptr_t)key >> 8 & 0xffff];
+}
+
+uint8_t request_num(void *key) {
+    return (uint8_t)(uintptr_t)key;
+}
+
+bool request_current(void *key) {
+    return (uint8_t)((uintptr_t)key >> 24) == (uint8_t)request_device(key).link_generation;
+}
+
+// Ends a request without a response from the device
+void fail_request(void *key, int error, bool reset_link) {
+    if (!request_current(key)) {
+        return;
+    }
+    auto &d = request_device(key);
+    auto node = d.request_handlers.extract(request_num(key));
+    if (node.empty()) {
+        return;
+    }
+    LOG("Request {} failed: {}", (int)request_num(key), strerror(-error));
+    end_request(d);
+    if (reset_link) {
+        disconnect(d);
+    }
+    complete_request(d, request_num(key), node.mapped(), error);
+}
+
+void TokenBucket::refill() {
+    auto now = std::chrono::steady_clock::now();
+    tokens = std::min<double>(TX_BURST, tokens + (double)to_us(now - last_refill).count() / to_us(TX_REFILL_INTERVAL).count());
+    last_refill = now;
+}
+
+bool TokenBucket::take() {
+    refill();
+    if (tokens < 1) {
+        return false;
+    }
+    tokens -= 1;
+    return true;
+}
+
+std::chrono::microseconds TokenBucket::time_to_token() {
+    refill();
+    return tokens >= 1 ? 0us : std::chrono::microseconds((int64_t)((1 - tokens) * to_us(TX_REFILL_INTERVAL).count()));
+}
+
+// Sends a frame and registers it for its response. Returns the request number or a negative errno.
+int send_frame(Device &d, const std::vector<uint8_t> &value) {
+    if (d.tx_path.empty()) {
+        LOG("write_value: TX characteristic is not resolved");
+        return -ENOENT;
+    }
+    if (value.size() + 3 > MAX_FRAME_SIZE) {
+        return -EMSGSIZE;
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint8_t req_num = d.device_state.ctr++;
+    uint8_t frame[MAX_FRAME_SIZE];
+    size_t frame_size = value.size() + 3;
+    frame[0] = 0x55;
+    frame[1] = req_num;
+    memcpy(&frame[2], value.data(), value.size());
+    frame[2 + value.size()] = 0xaa;
+
+    bool sent = false;
+    if (d.write_fd >= 0 && frame_size <= d.write_mtu) {
+        if (write(d.write_fd, frame, frame_size) == (ssize_t)frame_size) {
+            sent = true;
+            g.metrics.marshal_fd.add(to_us(std::chrono::steady_clock::now() - start));
+        } else {
+            LOG("write_value: TX socket failed, falling back to WriteValue: {}", strerror(errno));
+            release_write(d);
+        }
+    }
+    int r;
+    sd_bus_message *m = nullptr;
+    if (!sent) {
+        r = sd_bus_message_new_method_call(g.bus, &m, "org.bluez", d.tx_path.c_str(),
+                                       "org.bluez.GattCharacteristic1", "WriteValue");
+        if (r < 0) {
+            LOG("write_value: failed to create method: {}", strerror(-r));
+            return r;
+        }
+        r = sd_bus_message_append_array(m, 'y', frame, frame_size);
+        if (r < 0) {
+            LOG("write_value: failed to push method parameters - data: {}", strerror(-r));
+            sd_bus_message_unrefp(&m);
+            return r;
+        }
+        r = sd_bus_message_append(m, "a{sv}", 1, "type", "s", "command");
+        if (r < 0) {
+            LOG("write_value: failed to push method parameters - options: {}", strerror(-r));
+            sd_bus_message_unrefp(&m);
+            return r;
+        }
+    }
+    bool during_discovery = begin_request(d);
+    d.request_handlers[req_num] = Request{nullptr, nullptr, std::chrono::steady_clock::now(), during_discovery};
+    if (m) {
+        sd_bus_call_async(g.bus, nullptr, m, [](sd_bus_message *reply, void *userdata, sd_bus_error *ret_error){
+            if (sd_bus_message_is_method_error(reply, nullptr)) {
+                fail_request(userdata, -sd_bus_message_get_errno(reply), false);
+            }
+            return 0;
+        }, request_key(d, req_num), to_us(WRITE_VALUE_TIMEOUT).count());
+        sd_bus_message_unrefp(&m);
+        g.metrics.marshal_dbus.add(to_us(std::chrono::steady_clock::now() - start));
+    }
+    sd_event_source *timeout = nullptr;
+    sd_event_add_time_relative(g.event, &timeout, CLOCK_MONOTONIC, to_us(2s).count(), 0, [](sd_event_source *s, uint64_t usec, void *userdata){
+        fail_request(userdata, -ETIMEDOUT, true);
+        return 0;
+    }, request_key(d, req_num));
+    float_source(timeout, PRIORITY_STATE);
+    return req_num;
+}
+
+// Awaits the device's response to a frame sent with send_frame()
+struct Response {
+    Device &d;
+    uint8_t req_num;
+    int r = 0;
+
+    bool await_ready() {
+        auto node = d.early_results.extract(req_num);
+        if (node.empty()) {
+            return false;
+        }
+        r = node.mapped();
+        return true;
+    }
+
+    // The request is gone if the link reset since it was sent
+    bool await_suspend(std::coroutine_handle<> h) {
+        auto it = d.request_handlers.find(req_num);
+        if (it == d.request_handlers.end()) {
+            r = -ECONNRESET;
+            return false;
+        }
+        it->second.waiter = h;
+        it->second.result = &r;
+        return true;
+    }
+
+    int await_resume() {
+        return r;
+    }
+};
+
+void drain_tx_queue(Device &d);
+
+void arm_tx_timer(Device &d) {
+    uint64_t usec = to_us(d.tx_bucket.time_to_token()).count();
+    if (!d.tx_source) {
+        sd_event_add_time_relative(g.event, &d.tx_source, CLOCK_MONOTONIC, usec, 0, [](sd_event_source *s, uint64_t usec, void *userdata){
+            drain_tx_queue(*(Device *)userdata);
+            return 0;
+        }, &d);
+        sd_event_source_set_priority(d.tx_source, PRIORITY_COMMANDS);
+        return;
+    }
+    sd_event_source_set_time_relative(d.tx_source, usec);
+    sd_event_source_set_enabled(d.tx_source, SD_EVENT_ONESHOT);
+}
+
+// Wakes up writers waiting for tokens, in priority order
+void drain_tx_queue(Device &d) {
+    while (!d.tx_queue.empty() && d.tx_bucket.take()) {
+        TxFrame frame = d.tx_queue.front();
+        d.tx_queue.pop_front();
+        *frame.result = 0;
+        frame.waiter.resume();
+    }
+    if (!d.tx_queue.empty()) {
+        arm_tx_timer(d);
+    }
+}
+
+// Awaits a token from the device's rate limiter. Resumes with -EBUSY if the frame is rejected.
+struct TxSlot {
+    Device &d;
+    Priority priority;
+    int r = 0;
+
+    bool await_ready() {
+        if (d.tx_queue.empty() && d.tx_bucket.take()) {
+            return true;
+        }
+        if (priority == Low || (priority == Normal && d.tx_queue.size() >= TX_QUEUE_LIMIT)) {
+            LOG("Rate limit: rejecting {} priority frame", magic_enum::enum_name(priority));
+            g.metrics.rejected_writes++;
+            r = -EBUSY;
+            return true;
+        }
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        g.metrics.delayed_writes++;
+        auto it = std::find_if(d.tx_queue.begin(), d.tx_queue.end(), [&](const TxFrame &frame){
+            return frame.priority < priority;
+        });
+        d.tx_queue.insert(it, TxFrame{h, &r, priority});
+        if (d.tx_queue.size() == 1) {
+            arm_tx_timer(d);
+        }
+    }
+
+    int await_resume() {
+        return r;
+    }
+};
+
+// Writes a frame subject to the device's rate limit and waits for the response. The frame must outlive
+// the returned task, i.e. the task must be awaited right away.
+Task write_request(Device &d, const std::vector<uint8_t> &value, Priority priority = High) {
+    int r = co_await TxSlot{d, priority};
+    if (r < 0) {
+        co_return r;
+    }
+    r = send_frame(d, value);
+    if (r < 0) {
+        co_return r;
+    }
+    co_return co_await Response{d, (uint8_t)r};
+}
+
+Task start_notify(Device &d) {
+    LOG("Starting notify on RX");
+    sd_bus_message *m = nullptr;
+    int r = sd_bus_message_new_method_call(g.bus, &m, "org.bluez", d.rx_path.c_str(),
+                                           "org.bluez.GattCharacteristic1", "StartNotify");
+    if (r < 0) {
+        co_return r;
+    }
+    BusCall call{m, 0};
+    r = co_await call;
+    // BlueZ refuses a second StartNotify from the same client while notifications are still on
+    if (r < 0 && call.error_name == "org.bluez.Error.InProgress") {
+        r = 0;
+    }
+    if (r < 0) {
+        LOG("Can't start notify on RX: {} {}", call.error_name, strerror(-r));
+    } else {
+        LOG("Finished starting notify on RX");
+    }
+    co_return r;
+}
+
+const CommandCodes &command_codes(const Device &d) {
+    return with_profile(d.config->model, []<typename P>(P) -> const CommandCodes & {
+        return P::commands;
+    });
+}
+
+template <typename P>
+std::vector<uint8_t> encode_auth(const uint8_t *key) {
+    std::vector<uint8_t> cmd{P::commands.auth};
+    std::copy(key, key + P::key_size, std::back_inserter(cmd));
+    return cmd;
+}
+
+// The program has to be supported by the model
+template <typename P>
+std::vector<uint8_t> encode_set_program(const StartParams &params) {
+    auto time = params.time.count();
+    auto delay = params.delay.count();
+    return {P::commands.set_program, *program_code<P>(params.program), 0, (uint8_t)params.temperature,
+            (uint8_t)(time / 60), (uint8_t)(time % 60), (uint8_t)(delay / 60), (uint8_t)(delay % 60), 1};
+}
+
+Task authorize(Device &d) {
+    if (d.device_state.state >= Authorized) {
+        co_return 0;
+    }
+    int r = co_await start_notify(d);
+    if (r < 0) {
+        co_return r;
+    }
+    LOG("Writing authorization request...");
+    auto cmd = with_profile(d.config->model, [&]<typename P>(P) {
+        return encode_auth<P>(d.config->key);
+    });
+    r = co_await write_request(d, cmd);
+    if (r < 0) {
+        co_return r;
+    }
+    LOG("Authorization request sent");
+    if (d.device_state.state < Authorized) {
+        LOG("Authorization of {} refused, pairing is needed", d.config->addr);
+        co_return -EACCES;
+    }
+    co_return 0;
+}
+
+Task query(Device &d) {
+    std::vector<uint8_t> ping{command_codes(d).ping};
+    std::vector<uint8_t> query{command_codes(d).query};
+    LOG("Sending ping");
+    int r = co_await write_request(d, ping, Normal);
+    if (r < 0) {
+        co_return r;
+    }
+    LOG("Sent ping, sending query");
+    r = co_await write_request(d, query, Normal);
+    if (r < 0) {
+        co_return r;
+    }
+    LOG("Sent query");
+    co_return 0;
+}
+
+Task turnoff(Device &d, Priority priority) {
+    std::vector<uint8_t> off{command_codes(d).off};
+    LOG("Sending turnoff");
+    int r = co_await write_request(d, off, priority);
+    if (r >= 0) {
+        LOG("Sent turnoff");
+    }
+    co_return r;
+}
+
+// Sets the program and starts it without waiting for the first response in between, then confirms with a query
+// sent is set once the start frame went out, from then on a failure may still have started the program
+Task start_program(Device &d, StartParams params, Priority priority, bool &sent) {
+    auto set_program = with_profile(d.config->model, [&]<typename P>(P) {
+        return encode_set_program<P>(params);
+    });
+    std::vector<uint8_t> start{command_codes(d).start};
+    LOG("Starting {} on {}", magic_enum::enum_name(params.program), d.config->addr);
+    // Both tokens are taken first, so nothing can suspend between the two writes
+    int r = co_await TxSlot{d, priority};
+    if (r >= 0) {
+        r = co_await TxSlot{d, priority};
+    }
+    if (r < 0) {
+        co_return r;
+    }
+    int set_num = send_frame(d, set_program);
+    if (set_num < 0) {
+        co_return set_num;
+    }
+    int start_num = send_frame(d, start);
+    sent = start_num >= 0;
+    r = co_await Response{d, (uint8_t)set_num};
+    if (start_num < 0) {
+        co_return start_num;
+    }
+    int start_r = co_await Response{d, (uint8_t)start_num};
+    if (r < 0 || start_r < 0) {
+        co_return r < 0 ? r : start_r;
+    }
+    std::vector<uint8_t> query{command_codes(d).query};
+    r = co_await write_request(d, query, priority);
+    if (r < 0) {
+        co_return r;
+    }
+    auto state = d.device_state.state;
+    if (d.device_state.program != params.program || (state != Heating && state != Delayed && state != On)) {
+        LOG("{} didn't start: {}", d.config->addr, d.device_state.to_json());
+        co_return -EIO;
+    }
+    LOG("Started {} on {}", magic_enum::enum_name(params.program), d.config->addr);
+    co_return 0;
+}
+
+bool owns_lease(const Device &d) {
+    return g.bridge_id.empty() ||
+           (d.lease.owner == g.bridge_id && std::chrono::steady_clock::now() < d.lease.expires);
+}
+
+bool lease_live(const Device &d) {
+    return !d.lease.owner.empty() && std::chrono::steady_clock::now() < d.lease.expires &&
+           (d.lease.owner == g.bridge_id || g.bridges.count(d.lease.owner));
+}
+
+bool unreachable(const Device &d) {
+    return d.unreachable_since.time_since_epoch().count() &&
+           std::chrono::steady_clock::now() - d.unreachable_since > LEASE_UNREACHABLE_TIMEOUT;
+}
+
+// Another instance that is still around holds a live lease. A free device, or one whose owner's Last Will
+// has arrived, is still ours to claim.
+bool held_elsewhere(const Device &d) {
+    return !g.bridge_id.empty() && d.lease.owner != g.bridge_id && lease_live(d);
+}
+
+void publish_lease(Device &d) {
+    int mid = -1;
+    mosquitto_property *props = nullptr;
+    mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, std::chrono::seconds(LEASE_TTL).count());
+    int rssi = unreachable(d) ? RSSI_UNKNOWN : d.rssi;
+    std::string lease_json = fmt::format("{{ \"owner\": {}, \"rssi\": {}}}", std::quoted(g.bridge_id), rssi);
+    mosquitto_publish_v5(g.mqtt, &mid, d.lease_topic.c_str(), lease_json.size(), lease_json.data(), 1, true, props);
+    mosquitto_property_free_all(&props);
+}
+
+// Renews our lease or claims the device if it's free or held with a clearly worse RSSI. Ownership is
+// only assumed when the claim comes back from the broker, so concurrent claims resolve to the last one.
+// A lease we can't make use of isn't renewed, and a stale RSSI is refreshed before it's compared.
+bool claim_lease(Device &d) {
+    if (g.bridge_id.empty()) {
+        return true;
+    }
+    if (!g.mqtt_connected || (owns_lease(d) && unreachable(d))) {
+        return owns_lease(d);
+    }
+    if (lease_live(d) && d.lease.owner != g.bridge_id) {
+        if (std::chrono::steady_clock::now() - d.rssi_at > DISCOVERY_MIN_INTERVAL) {
+            if (Adapter *a = find_adapter(d.adapter)) {
+                request_discovery(*a);
+            }
+            return false;
+        }
+        if (d.rssi <= d.lease.rssi + LEASE_RSSI_HYSTERESIS) {
+            return false;
+        }
+    }
+    if (d.lease.owner != g.bridge_id) {
+        LOG("Claiming lease on {} (rssi {})", d.config->addr, d.rssi);
+    }
+    publish_lease(d);
+    return owns_lease(d);
+}
+
+Task update_m223s_state(Device &d);
+
+void on_lease_message(Device &d, std::string_view payload) {
+    bool was_owner = owns_lease(d);
+    d.lease = Lease{};
+    if (auto owner = json_field(payload, "owner"); owner && !owner->empty()) {
+        d.lease.owner = *owner;
+        d.lease.rssi = json_int_field(payload, "rssi").value_or(RSSI_UNKNOWN);
+        d.lease.expires = std::chrono::steady_clock::now() + LEASE_TTL;
+    }
+    bool is_owner = owns_lease(d);
+    if (held_elsewhere(d) && !d.commands.empty()) {
+        // Every instance receives the commands, the owner runs and reports them
+        LOG("Dropping {} queued commands for {}, held by {}", d.commands.size(), d.config->addr, d.lease.owner);
+        d.commands.clear();
+    }
+    if (was_owner && !is_owner) {
+        LOG("Lost lease on {} to {}", d.config->addr, d.lease.owner.empty() ? "nobody" : d.lease.owner);
+        if (d.device_state.state >= Connected) {
+            disconnect(d);
+        }
+    } else if (!was_owner && is_owner) {
+        LOG("Acquired lease on {}", d.config->addr);
+        // A device being enrolled is polled once paired
+        if (!d.pairing) {
+            spawn(update_m223s_state(d));
+        }
+    }
+}
+
+void flush_commands(Device &d);
+
+Task establish_session(Device &d) {
+    if (d.device_path.empty()) {
+        d.device_path = find_device(d);
+    }
+    if (d.device_path.empty()) {
+        LOG("Device not found");
+        co_return -ENODEV;
+    }
+    if (!claim_lease(d)) {
+        LOG("Device {} is managed by {}", d.config->addr, d.lease.owner.empty() ? "nobody yet" : d.lease.owner);
+        co_return -EBUSY;
+    }
+    auto start = std::chrono::steady_clock::now();
+    int r = co_await connect(d);
+    if (r < 0) {
+        co_return r;
+    }
+    r = co_await ServicesResolved{d};
+    if (r < 0) {
+        LOG("Services of {} not resolved: {}", d.config->addr, strerror(-r));
+        co_return r;
+    }
+    r = co_await GattResolver{d};
+    if (r < 0) {
+        LOG("Characteristics not found");
+        co_return r;
+    }
+    watch_rx(d);
+    acquire_write(d);
+    r = co_await authorize(d);
+    if (r < 0) {
+        co_return r;
+    }
+    LOG("Ready");
+    g.metrics.mark(Device_ready);
+    if (d.connected_since >= start) {
+        g.metrics.session_setup.add(to_us(std::chrono::steady_clock::now() - start));
+    }
+    touch_link(d);
+    co_return 0;
+}
+
+// Awaits the result of the session being opened by someone else
+struct SessionJoin {
+    Device &d;
+    int r = 0;
+
+    bool await_ready() {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        d.session_waiters.emplace_back(h, &r);
+    }
+
+    int await_resume() {
+        return r;
+    }
+};
+
+// Connects and authorizes the device if needed and flushes queued commands. Device and GATT paths are
+// reused from previous sessions when known, so an on-demand reconnect costs only Connect, StartNotify and
+// auth.
+Task open_session(Device &d) {
+    if (d.session_opening) {
+        co_return co_await SessionJoin{d};
+    }
+    d.session_opening = true;
+    int r = co_await establish_session(d);
+    d.session_opening = false;
+    if (r >= 0) {
+        d.unreachable_since = {};
+    } else if (r != -EBUSY && !d.unreachable_since.time_since_epoch().count()) {
+        d.unreachable_since = std::chrono::steady_clock::now();
+    }
+    auto waiters = std::move(d.session_waiters);
+    d.session_waiters.clear();
+    for (auto &[waiter, result] : waiters) {
+        *result = r;
+        waiter.resume();
+    }
+    if (r >= 0) {
+        flush_commands(d);
+    }
+    co_return r;
+}
+
+void publish_command_status(Device &d, const Command &c, std::string_view status) {
+    for (auto &requester : c.requesters) {
+        int mid = -1;
+        std::string request_id = requester.empty() ? "" : FMT(", \"request_id\": {}", std::quoted(requester));
+        std::string status_json = fmt::format("{{ \"device\": {}, \"command\": {}, \"status\": {}{}}}",
+                                              std::quoted(d.config->addr),
+                                              std::quoted(friendly(magic_enum::enum_name(c.kind))),
+                                              std::quoted(status),
+                                              request_id);
+        mosquitto_publish(g.mqtt, &mid, M223S_STATUS_TOPIC, status_json.size(), status_json.data(), false, false);
+    }
+}
+
+// Drops and reports expired commands, then arms the expiry timer for the earliest remaining deadline
+void expire_commands(Device &d) {
+    auto now = std::chrono::steady_clock::now();
+    auto expired = std::stable_partition(d.commands.begin(), d.commands.end(), [&](const Command &c){
+        return c.deadline > now;
+    });
+    for (auto it = expired; it != d.commands.end(); ++it) {
+        LOG("Command {} for {} expired", magic_enum::enum_name(it->kind), d.config->addr);
+        publish_command_status(d, *it, "expired");
+    }
+    d.commands.erase(expired, d.commands.end());
+    if (d.commands.empty()) {
+        if (d.expiry_source) {
+            sd_event_source_set_enabled(d.expiry_source, SD_EVENT_OFF);
+        }
+        return;
+    }
+    auto deadline = std::min_element(d.commands.begin(), d.commands.end(), [](const Command &a, const Command &b){
+        return a.deadline < b.deadline;
+    })->deadline;
+    uint64_t usec = to_us(deadline.time_since_epoch()).count();
+    if (!d.expiry_source) {
+        sd_event_add_time(g.event, &d.expiry_source, CLOCK_MONOTONIC, usec, 0, [](sd_event_source *s, uint64_t usec, void *userdata){
+            expire_commands(*(Device *)userdata);
+            return 0;
+        }, &d);
+        return;
+    }
+    sd_event_source_set_time(d.expiry_source, usec);
+    sd_event_source_set_enabled(d.expiry_source, SD_EVENT_ONESHOT);
+}
+
+std::optional<Command> take_sent_command(Device &d, uint64_t id) {
+    auto it = std::find_if(d.sent_commands.begin(), d.sent_commands.end(), [&](const Command &c){
+        return c.id == id;
+    });
+    if (it == d.sent_commands.end()) {
+        return std::nullopt;
+    }
+    Command c = std::move(*it);
+    d.sent_commands.erase(it);
+    return c;
+}
+
+Task run_command(Device &d, uint64_t id, CommandKind kind, Priority priority, StartParams start) {
+    g.metrics.workflows++;
+    int r = 0;
+    bool sent = false;
+    switch (kind) {
+    case Turn_off:
+        r = co_await turnoff(d, priority);
+        break;
+    case Start:
+        r = co_await start_program(d, start, priority, sent);
+        break;
+    }
+    auto c = take_sent_command(d, id);
+    if (!c) {
+        co_return r;
+    }
+    if (r == -EBUSY) {
+        publish_command_status(d, *c, "rejected");
+    } else if (r < 0 && sent) {
+        // The cooker may have got the start, repeating it could start the program again or much later
+        LOG("Command {} for {} failed: {}", magic_enum::enum_name(kind), d.config->addr, strerror(-r));
+        publish_command_status(d, *c, "failed");
+    } else if (r < 0) {
+        // Failed commands go back to the queue and are retried with the next session until they expire
+        d.commands.push_back(std::move(*c));
+        expire_commands(d);
+    } else {
+        auto now = std::chrono::steady_clock::now();
+        g.metrics.command.add(to_us(now - c->received));
+        if (c->kind == Start) {
+            g.metrics.start.add(to_us(now - c->received));
+        }
+        d.last_done[c->kind] = now;
+        publish_command_status(d, *c, "done");
+    }
+    co_return r;
+}
+
+void send_command(Device &d, Command c) {
+    uint64_t id = c.id;
+    CommandKind kind = c.kind;
+    Priority priority = c.priority;
+    StartParams start = c.start;
+    d.sent_commands.push_back(std::move(c));
+    spawn(run_command(d, id, kind, priority, start));
+}
+
+// Sends queued commands in priority order once the device is authorized
+void flush_commands(Device &d) {
+    expire_commands(d);
+    if (d.commands.empty() || d.device_state.state < Authorized) {
+        return;
+    }
+    auto commands = std::move(d.commands);
+    d.commands.clear();
+    std::stable_sort(commands.begin(), commands.end(), [](const Command &a, const Command &b){
+        return a.priority > b.priority;
+    });
+    for (auto &c : commands) {
+        send_command(d, std::move(c));
+    }
+}
+
+bool is_idempotent(CommandKind kind) {
+    switch (kind) {
+    case Turn_off:
+        return true;
+    case Start:
+        return false;
+    }
+    return false;
+}
+
+// Merges the command into an identical queued, in-flight or just completed one
+bool coalesce_command(Device &d, Command &c) {
+    if (!is_idempotent(c.kind)) {
+        return false;
+    }
+    for (auto *commands : {&d.commands, &d.sent_commands}) {
+        for (auto &other : *commands) {
+            if (other.kind == c.kind) {
+                LOG("Merging command {} into pending one", magic_enum::enum_name(c.kind));
+                other.requesters.insert(other.requesters.end(), c.requesters.begin(), c.requesters.end());
+                other.deadline = std::max(other.deadline, c.deadline);
+                // A queued command keeps the most urgent of its requesters' priorities
+                other.priority = std::max(other.priority, c.priority);
+                g.metrics.merged_commands++;
+                return true;
+            }
+        }
+    }
+    if (auto it = d.last_done.find(c.kind); it != d.last_done.end() && c.received - it->second < COMMAND_DEDUPE_WINDOW) {
+        LOG("Merging command {} into completed one", magic_enum::enum_name(c.kind));
+        publish_command_status(d, c, "done");
+        g.metrics.merged_commands++;
+        return true;
+    }
+    return false;
+}
+
+void enqueue_command(Device &d, Command c) {
+    c.id = g.next_command_id++;
+    if (coalesce_command(d, c)) {
+        return;
+    }
+    d.commands.push_back(std::move(c));
+    if (d.device_state.state >= Authorized) {
+        flush_commands(d);
+        return;
+    }
+    // Don't wait for the next poll to bring the link up
+    expire_commands(d);
+    spawn(open_session(d));
+}
+
+Task update_m223s_state(Device &d) {
+    LOG("Updating M223S {} state", d.config->addr);
+    g.metrics.workflows++;
+    int r = co_await open_session(d);
+    if (r >= 0) {
+        r = co_await query(d);
+    }
+    if (r < 0) {
+        LOG("Updating M223S {} state failed: {}", d.config->addr, strerror(-r));
+    }
+    co_return r;
+}
+
+int64_t unix_ms(std::chrono::system_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+}
+
+// Scheduled commands are kept in STATE_DIR/schedule, one job per line:
+//   <id> <unix ms> <device> <command> [<request id>]
+// Jobs that came due while the bridge was down still run after a restart, unless they're more than
+// COMMAND_TTL late.
+void save_schedule() {
+    std::string data;
+    for (auto &[id, job] : g.jobs) {
+        data += FMT("{} {} {} {} {}\n", id, job.at_ms, job.device, magic_enum::enum_name(job.command), job.requester);
+    }
+    write_file_atomically(FMT("{}/schedule", STATE_DIR), data);
+}
+
+void publish_schedule_result(std::string_view requester, const std::string &fields) {
+    int mid = -1;
+    std::string request_id = requester.empty() ? "" : FMT(", \"request_id\": {}", std::quoted(requester));
+    std::string result_json = FMT("{{ {}{}}}", fields, request_id);
+    mosquitto_publish(g.mqtt, &mid, M223S_SCHEDULE_RESULT_TOPIC, result_json.size(), result_json.data(), 1, false);
+}
+
+std::string job_json(const ScheduledJob &job) {
+    return FMT("\"job\": {}, \"device\": {}, \"command\": {}, \"at\": {}",
+               job.id,
+               std::quoted(job.device),
+               std::quoted(friendly(magic_enum::enum_name(job.command))),
+               job.at_ms / 1000);
+}
+
+void run_job(uint64_t id) {
+    auto node = g.jobs.extract(id);
+    if (node.empty()) {
+        return;
+    }
+    auto &job = node.mapped();
+    sd_event_source_unref(job.source);
+    save_schedule();
+    auto jitter = job.due ? std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - *job.due)
+                          : std::chrono::milliseconds(unix_ms(std::chrono::system_clock::now()) - job.at_ms);
+    Device *d = lookup_device(job.device);
+    if (!d) {
+        LOG("Dropping job {} for unknown device {}", id, job.device);
+        return;
+    }
+    if (jitter > COMMAND_TTL) {
+        LOG("Job {} missed by {} s", id, std::chrono::duration_cast<std::chrono::seconds>(jitter).count());
+        publish_schedule_result(job.requester, FMT("{}, \"status\": \"missed\"", job_json(job)));
+        return;
+    }
+    LOG("Running job {} ({} ms late)", id, jitter.count());
+    g.metrics.schedule_jitter.add(std::max(jitter, std::chrono::milliseconds(0)));
+    publish_schedule_result(job.requester, FMT("{}, \"status\": \"run\", \"jitter_ms\": {}", job_json(job), jitter.count()));
+    auto now = std::chrono::steady_clock::now();
+    enqueue_command(*d, Command{job.command, Normal, now, now + COMMAND_TTL, 0, {job.requester}});
+}
+
+// Arms a realtime timer for jobs at a wall-clock time, so clock adjustments move the run time with them, and
+// a monotonic one for jobs relative to when they were added
+void arm_job(ScheduledJob &job) {
+    auto handler = [](sd_event_source *s, uint64_t usec, void *userdata){
+        run_job((uint64_t)(uintptr_t)userdata);
+        return 0;
+    };
+    if (job.due) {
+        auto delay = std::max(*job.due - std::chrono::steady_clock::now(), std::chrono::steady_clock::duration::zero());
+        sd_event_add_time_relative(g.event, &job.source, CLOCK_MONOTONIC, to_us(delay).count(), 1000, handler,
+                                   (void *)(uintptr_t)job.id);
+    } else {
+        sd_event_add_time(g.event, &job.source, CLOCK_REALTIME, job.at_ms * 1000, 1000, handler,
+                          (void *)(uintptr_t)job.id);
+    }
+    sd_event_source_set_priority(job.source, PRIORITY_COMMANDS);
+}
+
+void load_schedule() {
+    char buf[16 * 1024];
+    int fd = open(FMT("{}/schedule", STATE_DIR).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    std::string_view data(buf, std::max<ssize_t>(n, 0));
+    // Every job ends with a newline, a line without one was cut short
+    while (data.find('\n') != std::string_view::npos) {
+        auto line = data.substr(0, data.find('\n'));
+        data.remove_prefix(line.size() + 1);
+        std::array<std::string_view, 5> fields;
+        for (size_t i = 0; i < fields.size(); i++) {
+            auto pos = i + 1 < fields.size() ? line.find(' ') : std::string_view::npos;
+            fields[i] = line.substr(0, pos);
+            line.remove_prefix(pos == std::string_view::npos ? line.size() : pos + 1);
+        }
+        ScheduledJob job;
+        auto [id_end, id_ec] = std::from_chars(fields[0].data(), fields[0].data() + fields[0].size(), job.id);
+        auto [at_end, at_ec] = std::from_chars(fields[1].data(), fields[1].data() + fields[1].size(), job.at_ms);
+        auto command = magic_enum::enum_cast<CommandKind>(fields[3]);
+        if (id_ec != std::errc() || at_ec != std::errc() || !command) {
+            LOG("Ignoring malformed scheduled job: {}", fields[0]);
+            continue;
+        }
+        job.device = fields[2];
+        job.command = *command;
+        job.requester = fields[4];
+        g.next_job_id = std::max(g.next_job_id, job.id + 1);
+        arm_job(g.jobs.emplace(job.id, std::move(job)).first->second);
+    }
+    LOG("Loaded {} scheduled jobs", g.jobs.size());
+}
+
+// Target time from "at" (Unix time, or HH:MM local time of the next occurrence) or "in" (seconds from now)
+std::optional<int64_t> parse_job_time(std::string_view payload) {
+    auto now = std::chrono::system_clock::now();
+    if (auto in = json_int_field(payload, "in")) {
+        return unix_ms(now + std::chrono::seconds(*in));
+    }
+    auto at = json_field(payload, "at");
+    if (!at) {
+        return std::nullopt;
+    }
+    auto colon = at->find(':');
+    if (colon == std::string_view::npos) {
+        auto t = parse_int(*at);
+        return t ? std::optional<int64_t>(*t * 1000ll) : std::nullopt;
+    }
+    auto hours = parse_int(at->substr(0, colon));
+    auto minutes = parse_int(at->substr(colon + 1));
+    if (!hours || !minutes || *hours < 0 || *hours > 23 || *minutes < 0 || *minutes > 59) {
+        return std::nullopt;
+    }
+    time_t t = std::chrono::system_clock::to_time_t(now);
+    tm local{};
+    localtime_r(&t, &local);
+    local.tm_hour = *hours;
+    local.tm_min = *minutes;
+    local.tm_sec = 0;
+    local.tm_isdst = -1;
+    time_t target = mktime(&local);
+    if (target <= t) {
+        local.tm_mday++;
+        local.tm_isdst = -1;
+        target = mktime(&local);
+    }
+    return target * 1000ll;
+}
+
+// Manages scheduled jobs: {"action": "add", "device", "command", "at" or "in"}, {"action": "remove", "job"}
+// or {"action": "list"}. Results go to M223S_SCHEDULE_RESULT_TOPIC.
+void on_schedule_message(std::string_view payload) {
+    auto action = json_field(payload, "action").value_or("add");
+    std::string requester(json_field(payload, "id").value_or(""));
+    // Job ids are only unique per instance, so every action is addressed to a device and answered by its owner
+    Device *d = lookup_device(json_field(payload, "device"));
+    if (!d) {
+        publish_schedule_result(requester, "\"status\": \"unknown device\"");
+        return;
+    }
+    if (!owns_lease(*d)) {
+        return;
+    }
+    if (action == "list") {
+        std::string jobs;
+        for (auto &[id, job] : g.jobs) {
+            if (job.device == d->config->addr) {
+                jobs += FMT("{}{{ {}}}", jobs.empty() ? "" : ", ", job_json(job));
+            }
+        }
+        publish_schedule_result(requester, FMT("\"jobs\": [{}]", jobs));
+        return;
+    }
+    if (action == "remove") {
+        auto id = json_int_field(payload, "job");
+        auto it = id ? g.jobs.find(*id) : g.jobs.end();
+        if (it == g.jobs.end() || it->second.device != d->config->addr) {
+            publish_schedule_result(requester, "\"status\": \"unknown job\"");
+            return;
+        }
+        std::string fields = FMT("{}, \"status\": \"removed\"", job_json(it->second));
+        sd_event_source_unref(it->second.source);
+        g.jobs.erase(it);
+        save_schedule();
+        publish_schedule_result(requester, fields);
+        return;
+    }
+    auto command = from_friendly<CommandKind>(json_field(payload, "command").value_or("turn off"));
+    auto at_ms = parse_job_time(payload);
+    // Start needs settings, the cooker's own delay covers starting later
+    if (!command || *command == Start || !at_ms) {
+        publish_schedule_result(requester, "\"status\": \"invalid\"");
+        return;
+    }
+    if (g.jobs.size() >= SCHEDULE_MAX_JOBS) {
+        publish_schedule_result(requester, "\"status\": \"full\"");
+        return;
+    }
+    // The request id ends a line of the schedule file
+    requester.resize(std::min(requester.size(), SCHEDULE_REQUESTER_LIMIT));
+    std::replace(requester.begin(), requester.end(), '\n', ' ');
+    std::optional<std::chrono::steady_clock::time_point> due;
+    if (auto in = json_int_field(payload, "in")) {
+        due = std::chrono::steady_clock::now() + std::chrono::seconds(*in);
+    }
+    ScheduledJob job{g.next_job_id++, d->config->addr, *command, *at_ms, due, requester};
+    auto &added = g.jobs.emplace(job.id, std::move(job)).first->second;
+    arm_job(added);
+    save_schedule();
+    LOG("Scheduled job {}: {}", added.id, job_json(added));
+    publish_schedule_result(requester, FMT("{}, \"status\": \"scheduled\"", job_json(added)));
+}
+
+// Parses {"program", "temperature", "time" and "delay" (minutes)}, missing settings take the program defaults
+std::optional<StartParams> parse_start(Model model, std::string_view payload) {
+    auto program = from_friendly<Program>(json_field(payload, "program").value_or(""));
+    auto limits_ptr = program ? program_limits(model, *program) : nullptr;
+    if (!limits_ptr) {
+        return std::nullopt;
+    }
+    auto &limits = *limits_ptr;
+    StartParams params{*program,
+                       json_int_field(payload, "temperature").value_or(limits.default_temperature),
+                       std::chrono::minutes(json_int_field(payload, "time").value_or(limits.default_time.count())),
+                       std::chrono::minutes(json_int_field(payload, "delay").value_or(0))};
+    if (params.temperature < limits.min_temperature || params.temperature > limits.max_temperature ||
+        params.time < limits.min_time || params.time > limits.max_time ||
+        params.delay < 0min || params.delay > MAX_START_DELAY || (params.delay > 0min && !limits.delay)) {
+        return std::nullopt;
+    }
+    return params;
+}
+
+void on_start_message(Device &d, const MqttMessage &msg) {
+    auto ttl = std::chrono::seconds(json_int_field(msg.payload, "ttl").value_or(std::chrono::seconds(COMMAND_TTL).count()));
+    std::string requester(json_field(msg.payload, "id").value_or(""));
+    auto priority = from_friendly<Priority>(json_field(msg.payload, "priority").value_or("")).value_or(High);
+    Command c{Start, priority, msg.received, msg.received + ttl, 0, {requester}};
+    auto params = parse_start(d.config->model, msg.payload);
+    if (!params) {
+        LOG("Invalid start command for {}: {}", d.config->addr, msg.payload);
+        publish_command_status(d, c, "invalid");
+        return;
+    }
+    c.start = *params;
+    enqueue_command(d, std::move(c));
+}
+
+void reload_config(std::string_view requester);
+
+void on_mqtt_message(const MqttMessage &msg) {
+    std::string_view topic = msg.topic;
+    std::string_view bridges_prefix = M223S_BRIDGES_TOPIC;
+    if (topic.size() > bridges_prefix.size() && topic.substr(0, bridges_prefix.size()) == bridges_prefix) {
+        std::string id(topic.substr(bridges_prefix.size() + 1));
+        if (msg.payload.empty()) {
+            LOG("Bridge {} went offline", id);
+            g.bridges.erase(id);
+        } else {
+            g.bridges.insert(id);
+        }
+        return;
+    }
+    if (msg.topic == M223S_HISTORY_TOPIC) {
+        on_history_query(msg.payload);
+        return;
+    }
+    if (msg.topic == M223S_SCHEDULE_TOPIC) {
+        on_schedule_message(msg.payload);
+        return;
+    }
+    if (msg.topic == M223S_CONTROL_TOPIC) {
+        if (json_field(msg.payload, "action") == "reload") {
+            reload_config(json_field(msg.payload, "id").value_or(""));
+        }
+        return;
+    }
+    for (auto &d : g.devices) {
+        if (d->removed) {
+            continue;
+        }
+        if (msg.topic == d->lease_topic) {
+            on_lease_message(*d, msg.payload);
+        } else if (held_elsewhere(*d)) {
+            // The owner got the same command and reports its result
+            continue;
+        } else if (msg.topic == d->config->off_topic) {
+            auto ttl = std::chrono::seconds(json_int_field(msg.payload, "ttl").value_or(std::chrono::seconds(COMMAND_TTL).count()));
+            std::string requester(json_field(msg.payload, "id").value_or(""));
+            auto priority = from_friendly<Priority>(json_field(msg.payload, "priority").value_or("")).value_or(High);
+            enqueue_command(*d, Command{Turn_off, priority, msg.received, msg.received + ttl, 0, {requester}});
+        } else if (msg.topic == d->config->start_topic) {
+            on_start_message(*d, msg);
+        }
+    }
+}
+
+// Polls are spread evenly over the polling interval so that devices don't share a tick. The first poll of
+// every device runs right away.
+// Also rearms the polls of a device after the polling interval changed
+void schedule_polls(Device &d) {
+    spawn(update_m223s_state(d));
+    auto interval = g.settings.polling_interval;
+    auto offset = interval * d.index / g.devices.size() + interval;
+    if (d.poll_source) {
+        sd_event_source_set_time_relative(d.poll_source, to_us(offset).count());
+        sd_event_source_set_enabled(d.poll_source, SD_EVENT_ON);
+        return;
+    }
+    sd_event_add_time_relative(g.event, &d.poll_source, CLOCK_MONOTONIC, to_us(offset).count(), 0, [](sd_event_source *s, uint64_t usec, void *userdata){
+        auto &d = *(Device *)userdata;
+        auto interval = to_us(g.settings.polling_interval).count();
+        uint64_t now = 0;
+        sd_event_now(g.event, CLOCK_MONOTONIC, &now);
+        g.metrics.dispatch_state.add(std::chrono::microseconds(now - std::min(now, usec)));
+        if (d.device_state.ctr * g.settings.polling_interval > 24h) {
+            disconnect(d);
+        }
+        spawn(update_m223s_state(d));
+        uint64_t next = usec + interval;
+        while (next <= now) {
+            next += interval;
+        }
+        sd_event_source_set_enabled(s, SD_EVENT_ON);
+        sd_event_source_set_time(s, next);
+        return 0;
+    }, &d);
+    sd_event_source_set_priority(d.poll_source, PRIORITY_STATE);
+}
+
+void start_polling() {
+    for (auto &d : g.devices) {
+        if (!d->pairing) {
+            schedule_polls(*d);
+        }
+    }
+}
+
+Device &add_device(const DeviceConfig &config) {
+    auto d = std::make_unique<Device>();
+    d->index = g.devices.size();
+    d->config = &config;
+    d->lease_topic = FMT("{}/{}", M223S_LEASE_TOPIC, config.addr);
+    d->state_file = FMT("{}/{}.json", STATE_DIR, config.addr);
+    restore_state(*d);
+    d->history.open(FMT("{}/{}.history", STATE_DIR, config.addr));
+    d->rule_states.assign(g.rules.size(), RuleState{});
+    g.devices.push_back(std::move(d));
+    return *g.devices.back();
+}
+
+void subscribe_device(const Device &d) {
+    int mid = -1;
+    mosquitto_subscribe(g.mqtt, &mid, d.config->off_topic, true);
+    mosquitto_subscribe(g.mqtt, &mid, d.config->start_topic, true);
+}
+
+void unsubscribe_device(const Device &d) {
+    int mid = -1;
+    mosquitto_unsubscribe(g.mqtt, &mid, d.config->off_topic);
+    mosquitto_unsubscribe(g.mqtt, &mid, d.config->start_topic);
 }
 
-void walk(const std::string &dest, const std::string &path, const std::function<void(const std::string &node, const std::string &interface)> &f) {
-    auto info = introspect(dest, path);
-    f(path, info.second);
-    for (auto &node : info.first) {
-        std::string leaf = path;
-        leaf += "/";
-        leaf += node;
-        walk(dest, leaf, f);
-    }
+// Enrolled devices get their own topics under the usual ones, e.g. home/m223s/state/<address>
+OwnedDeviceConfig owned_config(std::string_view addr, Model model, std::span<const uint8_t> key) {
+    OwnedDeviceConfig c;
+    c.addr = addr;
+    c.model = model;
+    std::copy(key.begin(), key.end(), c.key.begin());
+    c.state_topic = FMT("{}/{}", M223S_STATE_TOPIC, addr);
+    c.off_topic = FMT("{}/{}", M223S_OFF_TOPIC, addr);
+    c.start_topic = FMT("{}/{}", M223S_START_TOPIC, addr);
+    return c;
 }
 
-bool start_discovery(const std::string &adapter_name) {
-    sd_bus_message *reply = nullptr;
-    sd_bus_error e = SD_BUS_ERROR_NULL;
-    int r = sd_bus_call_method(g.bus, "org.bluez", FMT("/org/bluez/{}", adapter_name).c_str(),
-                               "org.bluez.Adapter1", "StartDiscovery", &e, &reply, "");
-    if (r < 0) {
-        LOG("Can't start discovery on {}: {}", adapter_name, strerror(-r));
-        return false;
-    }
-    LOG("Started discovery on {}", adapter_name);
-    sd_bus_message_unref(reply);
-    return true;
+OwnedDeviceConfig &add_enrolled(std::string_view addr, Model model, std::span<const uint8_t> key) {
+    auto &e = g.enrolled.emplace_back(owned_config(addr, model, key));
+    e.bind();
+    return e;
 }
 
-int stop_discovery(const std::string &adapter_name) {
-    sd_bus_message *reply = nullptr;
-    sd_bus_error e = SD_BUS_ERROR_NULL;
-    int r = sd_bus_call_method(g.bus, "org.bluez", FMT("/org/bluez/{}", adapter_name).c_str(),
-                               "org.bluez.Adapter1", "StopDiscovery", &e, &reply, "");
-    if (r < 0) {
-        LOG("Can't stop discovery on {}: {}", adapter_name, r);
-        return r;
-    } else {
-        LOG("Stopped discovery on {}", adapter_name);
-    }
-    sd_bus_message_unref(reply);
-    return r;
+size_t key_size(Model model) {
+    return with_profile(model, []<typename P>(P) {
+        return P::key_size;
+    });
 }
 
-bool start_discovery() {
-    if (g.last_start_discovery_time + DISCOVERY_MIN_INTERVAL > std::chrono::steady_clock::now()) {
-        LOG("Skipping discovery");
+bool parse_key(std::string_view hex, Model model, std::array<uint8_t, MAX_KEY_SIZE> &key) {
+    if (hex.size() != key_size(model) * 2) {
         return false;
     }
-
-    g.last_start_discovery_time = std::chrono::steady_clock::now();
-    bool r = false;
-    for (auto &s : g.adapters) {
-        if (bool rv = start_discovery(s); rv) {
-            r = rv;
+    for (size_t i = 0; i < key_size(model); i++) {
+        auto [end, ec] = std::from_chars(hex.data() + i * 2, hex.data() + i * 2 + 2, key[i], 16);
+        if (ec != std::errc() || end != hex.data() + i * 2 + 2) {
+            return false;
         }
     }
-    return r;
+    return true;
 }
 
-int stop_discovery() {
-    int r = -1;
-    for (auto &s : g.adapters) {
-        if (int rv = stop_discovery(s); rv > 0) {
-            r = rv;
+// One device per line: <address> <model> <key in hex>. Only devices that accepted their key are saved.
+void save_enrolled() {
+    std::string data;
+    for (auto &e : g.enrolled) {
+        auto d = lookup_device(e.addr);
+        if (!d || d->pairing) {
+            continue;
         }
+        data += FMT("{} {} ", e.addr, magic_enum::enum_name(e.config.model));
+        for (size_t i = 0; i < key_size(e.config.model); i++) {
+            data += FMT("{:02x}", e.key[i]);
+        }
+        data += '\n';
     }
-    return r;
+    write_file_atomically(FMT("{}/enrolled", STATE_DIR), data, 0600);
 }
 
-std::string get_string_property(const std::string &node, const std::string &interface, const std::string &member) {
-    sd_bus_message *reply = nullptr;
-    sd_bus_error e = SD_BUS_ERROR_NULL;
-    int r = sd_bus_get_property(g.bus, "org.bluez", node.c_str(),
-                                interface.c_str(), member.c_str(), &e, &reply, "s");
-    if (r < 0) {
-        return "";
+void load_enrolled() {
+    char buf[16 * 1024];
+    int fd = open(FMT("{}/enrolled", STATE_DIR).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
     }
-    const char *str;
-    sd_bus_message_read(reply, "s", &str);
-    std::string ret_str = str;
-    sd_bus_message_unref(reply);
-    return ret_str;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    std::string_view data(buf, std::max<ssize_t>(n, 0));
+    while (!data.empty()) {
+        auto line = data.substr(0, data.find('\n'));
+        data.remove_prefix(std::min(data.size(), line.size() + 1));
+        std::array<std::string_view, 3> fields;
+        for (size_t i = 0; i < fields.size(); i++) {
+            auto pos = i + 1 < fields.size() ? line.find(' ') : std::string_view::npos;
+            fields[i] = line.substr(0, pos);
+            line.remove_prefix(pos == std::string_view::npos ? line.size() : pos + 1);
+        }
+        auto model = magic_enum::enum_cast<Model>(fields[1]);
+        std::array<uint8_t, MAX_KEY_SIZE> key{};
+        if (!model || !parse_key(fields[2], *model, key) || lookup_device(fields[0])) {
+            LOG("Ignoring enrolled device: {}", fields[0]);
+            continue;
+        }
+        add_device(add_enrolled(fields[0], *model, std::span(key).first(key_size(*model))).config);
+    }
+    LOG("Loaded {} enrolled devices", g.enrolled.size());
 }
 
-bool get_boolean_property(const std::string &node, const std::string &interface, const std::string &member) {
-    sd_bus_message *reply = nullptr;
-    sd_bus_error e = SD_BUS_ERROR_NULL;
-    int r = sd_bus_get_property(g.bus, "org.bluez", node.c_str(),
-                                interface.c_str(), member.c_str(), &e, &reply, "b");
-    if (r < 0) {
+void publish_enrollment(const Device &d, std::string_view status) {
+    int mid = -1;
+    std::string enroll_json = fmt::format("{{ \"device\": {}, \"model\": {}, \"status\": {}}}",
+                                          std::quoted(d.config->addr),
+                                          std::quoted(friendly(magic_enum::enum_name(d.config->model))),
+                                          std::quoted(status));
+    mosquitto_publish(g.mqtt, &mid, M223S_ENROLL_TOPIC, enroll_json.size(), enroll_json.c_str(), 1, false);
+}
+
+// Resumes the awaiting coroutine after the duration, without blocking the loop
+struct Sleep {
+    std::chrono::microseconds duration;
+    sd_event_source *source = nullptr;
+
+    bool await_ready() {
         return false;
     }
-    bool ret = false;
-    sd_bus_message_read(reply, "b", &ret);
-    sd_bus_message_unref(reply);
-    return ret;
-}
 
-std::string wait_for_device() {
-    std::string ret;
-    bool discovery_started = false;
-    bool discovery_tried = false;
-
-    for (int i = 0; i < 5; i++) {
-        for (auto &adapter : g.adapters) {
-            std::string adapter_path = FMT("/org/bluez/{}", adapter);
-            auto nodes = introspect("org.bluez", adapter_path);
-            for (auto &node : nodes.first) {
-                std::string node_path = FMT("{}/{}", adapter_path, node);
-                std::string addr = get_string_property(node_path, "org.bluez.Device1", "Address");
-                if (addr == M223S_ADDR) {
-                    ret = node_path;
-                }
-            }
-        }
-        if (!ret.empty()) {
+    bool await_suspend(std::coroutine_handle<> h) {
+        return sd_event_add_time_relative(g.event, &source, CLOCK_MONOTONIC, duration.count(), 0,
+                                          [](sd_event_source *s, uint64_t usec, void *userdata){
+            std::coroutine_handle<>::from_address(userdata).resume();
+            return 0;
+        }, h.address()) >= 0;
+    }
+
+    void await_resume() {
+        sd_event_source_unref(source);
+    }
+};
+
+// Runs the pairing flow: the cooker refuses the new key until '+' is held on it
+Task enroll(Device &d) {
+    g.enrolling = true;
+    LOG("Enrolling {}, hold '+' on the cooker until it's paired", d.config->addr);
+    publish_enrollment(d, "pairing");
+    auto deadline = std::chrono::steady_clock::now() + ENROLL_PAIRING_TIMEOUT;
+    int r = 0;
+    while (true) {
+        r = co_await open_session(d);
+        // -EBUSY is final only if another instance holds the device, otherwise our claim is on its way
+        if (r >= 0 || (r == -EBUSY && held_elsewhere(d)) || std::chrono::steady_clock::now() + ENROLL_AUTH_INTERVAL > deadline) {
             break;
         }
-        if (!discovery_tried) {
-            discovery_started = start_discovery();
-            discovery_tried = true;
+        co_await Sleep{to_us(ENROLL_AUTH_INTERVAL)};
+    }
+    g.enrolling = false;
+    if (r < 0) {
+        LOG("Enrolling {} failed: {}", d.config->addr, strerror(-r));
+        publish_enrollment(d, "failed");
+        if (d.link.connected) {
+            disconnect(d);
         }
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        co_return r;
     }
-
-    if (discovery_started) {
-        stop_discovery();
+    LOG("Enrolled {}", d.config->addr);
+    d.pairing = false;
+    save_enrolled();
+    if (g.mqtt_connected) {
+        subscribe_device(d);
     }
-    return ret;
+    publish_enrollment(d, "enrolled");
+    schedule_polls(d);
+    co_return 0;
 }
 
-void connect(const std::function<void(const std::string &path)> &f) {
-    if (get_boolean_property(g.device_path, "org.bluez.Device1", "Connected")) {
-        f(g.device_path);
-        return;
-    }
-    g.device_state = DeviceState{};
-    g.device_state.update_state(Disconnected);
-    g.request_handlers.clear();
+// Device1 properties of an object BlueZ added, as far as enrollment needs them
+struct Advertisement {
+    std::string path;
+    std::string address;
+    std::string name;
+    bool service = false;
+};
 
-    sd_bus_message *reply = nullptr;
-    sd_bus_error e = SD_BUS_ERROR_NULL;
-    LOG("Connecting...");
-    int r = sd_bus_call_method(g.bus, "org.bluez", g.device_path.c_str(),
-                               "org.bluez.Device1", "Connect", &e, &reply, "");
-    if (r >= 0) {
-        LOG("Connected");
-        g.device_state.update_state(Connected);
-        sd_bus_message_unref(reply);
-        f(g.device_path);
-    } else {
-        LOG("Can't connect");
+void read_advertisement(Advertisement &adv, sd_bus_message *m) {
+    if (sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sv}") < 0) {
+        return;
     }
-}
-
-void disconnect() {
-    {
-        sd_bus_message *reply = nullptr;
-        sd_bus_error e = SD_BUS_ERROR_NULL;
-        LOG("Stopping notify on RX");
-        int r = sd_bus_call_method(g.bus, "org.bluez", g.rx_path.c_str(),
-                                 "org.bluez.GattCharacteristic1", "StopNotify",
-                                 &e, &reply, "");
-        if (r >= 0) {
-            LOG("Stopped notify on RX");
-            sd_bus_message_unref(reply);
+    while (sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "sv") > 0) {
+        const char *name = nullptr;
+        sd_bus_message_read(m, "s", &name);
+        std::string_view member = name ? name : "";
+        const char *value = nullptr;
+        if (member == "Address" && sd_bus_message_read(m, "v", "s", &value) >= 0) {
+            adv.address = value;
+        } else if (member == "Name" && sd_bus_message_read(m, "v", "s", &value) >= 0) {
+            adv.name = value;
+        } else if (member == "UUIDs" && sd_bus_message_enter_container(m, SD_BUS_TYPE_VARIANT, "as") > 0) {
+            sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "s");
+            while (sd_bus_message_read(m, "s", &value) > 0) {
+                adv.service = adv.service || value == SERVICE_UUID;
+            }
+            sd_bus_message_exit_container(m);
+            sd_bus_message_exit_container(m);
         } else {
-            LOG("Can't stop notify on RX");
+            sd_bus_message_skip(m, "v");
         }
+        sd_bus_message_exit_container(m);
     }
-    sd_bus_message *reply = nullptr;
-    sd_bus_error e = SD_BUS_ERROR_NULL;
-    LOG("Disconnecting...");
-    int r = sd_bus_call_method(g.bus, "org.bluez", g.device_path.c_str(),
-                               "org.bluez.Device1", "Disconnect", &e, &reply, "");
-    if (r >= 0) {
-        LOG("Disconnected");
-        sd_bus_message_unref(reply);
-    } else {
-        LOG("Can't disconnect");
-    }
-}
-
-std::string friendly(std::string_view sv) {
-    std::string s(sv);
-    std::replace(s.begin(), s.end(), '_', ' ');
-    return s;
+    sd_bus_message_exit_container(m);
 }
 
-std::string DeviceState::to_json() {
-    return fmt::format("{{ \"state\": {}, "
-                       "\"program\": {}, "
-                       "\"temperature\": {}, "
-                       "\"hours\": {}, "
-                       "\"minutes\": {}}}",
-                       std::quoted(friendly(magic_enum::enum_name(state))),
-                       std::quoted(friendly(magic_enum::enum_name(program))),
-                       temperature,
-                       hours,
-                       minutes);
+std::optional<Model> match_model(const Advertisement &adv) {
+    if (!adv.service) {
+        return std::nullopt;
+    }
+    for (auto &pattern : ENROLL_MODELS) {
+        if (fnmatch(pattern.name, adv.name.c_str(), 0) == 0) {
+            return pattern.model;
+        }
+    }
+    return std::nullopt;
 }
 
-void DeviceState::update_state(State state_) {
-    state = state_;
-    publish();
+bool enrollment_enabled() {
+    return g.settings.auto_enroll && g.bridge_id.empty();
 }
 
-void DeviceState::update_state(State state_, Program program_, int temperature_, int hours_, int minutes_) {
-    state = state_;
-    program = program_;
-    temperature = temperature_;
-    hours = hours_;
-    minutes = minutes_;
-    publish();
+// Enrolls a new matching device, or retries the pairing of one that timed out before
+void consider_enrollment(const Advertisement &adv) {
+    auto model = match_model(adv);
+    if (!enrollment_enabled() || !model || adv.address.empty() || g.enrolling) {
+        return;
+    }
+    auto d = lookup_device(adv.address);
+    if (d && !d->pairing) {
+        return;
+    }
+    if (!d) {
+        std::array<uint8_t, MAX_KEY_SIZE> key{};
+        if (getrandom(key.data(), key.size(), 0) != (ssize_t)key.size()) {
+            LOG("Can't generate a key for {}: {}", adv.address, strerror(errno));
+            return;
+        }
+        d = &add_device(add_enrolled(adv.address, *model, std::span(key).first(key_size(*model))).config);
+        d->pairing = true;
+    }
+    // Object paths are /org/bluez/<adapter>/dev_<address>
+    std::string_view path = adv.path;
+    path.remove_prefix(std::min(path.size(), sizeof("/org/bluez/") - 1));
+    d->adapter = path.substr(0, path.find('/'));
+    d->device_path = adv.path;
+    track_device(*d);
+    spawn(enroll(*d));
 }
 
-void DeviceState::publish() {
-    int mid = -1;
-    std::string state_json = to_json();
-    mosquitto_publish(g.mqtt, &mid, M223S_STATE_TOPIC, state_json.size(), state_json.data(), true, false);
+int on_interfaces_added(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    (void)ret_error;
+    const char *path = nullptr;
+    if (sd_bus_message_read(m, "o", &path) < 0 || sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sa{sv}}") < 0) {
+        return 0;
+    }
+    while (sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "sa{sv}") > 0) {
+        const char *interface = nullptr;
+        sd_bus_message_read(m, "s", &interface);
+        if (interface && strcmp(interface, "org.bluez.Device1") == 0) {
+            Advertisement adv{path};
+            read_advertisement(adv, m);
+            consider_enrollment(adv);
+        } else {
+            sd_bus_message_skip(m, "a{sv}");
+        }
+        sd_bus_message_exit_container(m);
+    }
+    return 0;
 }
 
-void on_new_value(const std::vector<uint8_t> &value) {
-    if (value.size() < 4) {
-        LOG("Value too short :(");
+// New devices show up as InterfacesAdded during discovery windows. Windows opened for enrollment are
+// scheduled like any other, so they pause while commands are in flight.
+void start_enrollment() {
+    if (g.enrollment_started) {
+        return;
+    }
+    g.enrollment_started = true;
+    int r = sd_bus_match_signal(g.bus, nullptr, "org.bluez", "/", "org.freedesktop.DBus.ObjectManager",
+                                "InterfacesAdded", on_interfaces_added, nullptr);
+    if (r < 0) {
+        LOG("Can't watch for new devices: {}", strerror(-r));
         return;
     }
-    if (value[2] == CMD_CODE_AUTH) {
-        g.device_state.update_state(value[3] ? Authorized : Connected);
+    sd_event_source *timer = nullptr;
+    sd_event_add_time_relative(g.event, &timer, CLOCK_MONOTONIC, 0, 0, [](sd_event_source *s, uint64_t usec, void *userdata){
+        for (auto &a : g.adapters) {
+            if (enrollment_enabled()) {
+                request_discovery(a);
+            }
+        }
+        sd_event_source_set_enabled(s, SD_EVENT_ON);
+        sd_event_source_set_time_relative(s, to_us(ENROLL_DISCOVERY_INTERVAL).count());
+        return 0;
+    }, nullptr);
+    float_source(timer, PRIORITY_HOUSEKEEPING);
+}
 
-    } else if (value[2] == CMD_CODE_QUERY) {
-        if (value.size() < 20) {
-            LOG("Value too short :(");
-            return;
+std::vector<std::string_view> split_words(std::string_view line) {
+    std::vector<std::string_view> words;
+    while (true) {
+        auto start = line.find_first_not_of(" \t");
+        if (start == std::string_view::npos) {
+            return words;
         }
-        g.device_state.update_state((State)value[11], (Program)value[3], value[5], value[8], value[9]);
-    }
-    auto node = g.request_handlers.extract(value[1]);
-    if (!node.empty() && node.mapped()) {
-        (node.mapped())();
+        line.remove_prefix(start);
+        auto end = std::min(line.find_first_of(" \t"), line.size());
+        words.push_back(line.substr(0, end));
+        line.remove_prefix(end);
     }
 }
 
-int on_rx_message(sd_bus_message *m, void *userdata, sd_bus_error *ret_error){
-    (void)m;
-    (void)userdata;
-    (void)ret_error;
-
-    sd_bus_message *reply = nullptr;
-    sd_bus_error e = SD_BUS_ERROR_NULL;
-    int r;
-    r = sd_bus_get_property(g.bus, "org.bluez", g.rx_path.c_str(),
-                            "org.bluez.GattCharacteristic1", "Value", &e, &reply, "ay");
-    if (r >= 0) {
-        fmt::print(stderr, "New value:");
-        const void *arr = nullptr;
-        size_t len = 0;
-        sd_bus_message_read_array(reply, 'y', &arr, &len);
-        for (int i = 0; i < len; i++) {
-            fmt::print(stderr, " {:02x}", ((uint8_t *)arr)[i]);
+bool parse_setting(Settings &settings, const std::vector<std::string_view> &words) {
+    auto &key = words[0];
+    if (key == "broker" && (words.size() == 2 || words.size() == 3)) {
+        settings.broker_host = words[1];
+        auto port = words.size() == 3 ? parse_int(words[2]) : MQTT_PORT;
+        settings.broker_port = port.value_or(0);
+        return port.has_value();
+    } else if ((key == "polling_interval" || key == "metrics_interval") && words.size() == 2) {
+        auto interval = parse_duration(words[1]);
+        if (!interval || *interval <= 0ms) {
+            return false;
         }
-        fmt::print(stderr, "\n");
-        on_new_value(std::vector<uint8_t>{(const uint8_t *)arr, (const uint8_t *)arr + len});
-    } else {
-        LOG("Can't process new RX value: {}", strerror(-r));
+        (key == "polling_interval" ? settings.polling_interval : settings.metrics_interval) = *interval;
+        return true;
+    } else if (key == "auto_enroll" && words.size() == 2 && (words[1] == "on" || words[1] == "off")) {
+        settings.auto_enroll = words[1] == "on";
+        if (settings.auto_enroll && !g.bridge_id.empty()) {
+            LOG("Ignoring auto_enroll, enrolled keys aren't shared between bridges");
+        }
+        return true;
+    } else if (key == "device" && (words.size() == 4 || words.size() == 7)) {
+        auto model = from_friendly<Model>(words[2]);
+        std::array<uint8_t, MAX_KEY_SIZE> key{};
+        if (!model || !parse_key(words[3], *model, key)) {
+            return false;
+        }
+        auto &c = settings.devices.emplace_back(owned_config(words[1], *model, std::span(key).first(key_size(*model))));
+        if (words.size() == 7) {
+            c.state_topic = words[4];
+            c.off_topic = words[5];
+            c.start_topic = words[6];
+        }
+        return true;
     }
-    return 0;
+    return false;
 }
 
-void initialize_paths(const std::string &path) {
-    walk("org.bluez", path, [&](const std::string &node, const std::string &interface){
-        std::string uuid = get_string_property(node, interface, "UUID");
-        if (uuid == TX_UUID) {
-            g.tx_path = node;
-        } else if (uuid == RX_UUID) {
-            g.rx_path = node;
+// Defaults if the file doesn't exist, nothing if it's invalid
+std::optional<Settings> read_settings() {
+    const char *path = getenv("M223S_CONFIG");
+    path = path ? path : CONFIG_FILE;
+    char buf[16 * 1024];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return Settings{};
         }
-    });
-    if (!g.rx_path.empty() && !g.rx_slot) {
-        sd_bus_attach_event(g.bus, g.event, 0);
-        int r = sd_bus_match_signal(g.bus, &g.rx_slot, "org.bluez", g.rx_path.c_str(),
-                                    "org.freedesktop.DBus.Properties", "PropertiesChanged", on_rx_message, nullptr);
-        if (r >= 0) {
-            LOG("Initialized RX notify slot");
-        } else {
-            LOG("Failed to initialize RX notify slot");
+        LOG("Can't read {}: {}", path, strerror(errno));
+        return std::nullopt;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    std::string_view data(buf, std::max<ssize_t>(n, 0));
+    Settings settings;
+    for (int line_num = 1; !data.empty(); line_num++) {
+        auto line = data.substr(0, data.find('\n'));
+        data.remove_prefix(std::min(data.size(), line.size() + 1));
+        auto words = split_words(line.substr(0, line.find('#')));
+        if (!words.empty() && !parse_setting(settings, words)) {
+            LOG("Invalid line {} of {}: {}", line_num, path, line);
+            return std::nullopt;
         }
     }
+    return settings;
 }
 
-void write_request(const std::vector<uint8_t> &value, std::function<void()> then) {
-    int r;
-    sd_bus_message *m;
-    r = sd_bus_message_new_method_call(g.bus, &m, "org.bluez", g.tx_path.c_str(),
-                                   "org.bluez.GattCharacteristic1", "WriteValue");
-    if (r < 0) {
-        LOG("write_value: failed to create method: {}", strerror(-r));
-        return;
+bool is_enrolled(const Device &d) {
+    return std::any_of(g.enrolled.begin(), g.enrolled.end(), [&](auto &e){ return &e.config == d.config; });
+}
+
+// Drops a device the config no longer lists. Its config is copied, as the settings it points into are
+// replaced, and its D-Bus matches are dropped so nothing calls back into it.
+void retire_device(Device &d) {
+    LOG("Removing {}", d.config->addr);
+    auto &c = g.retired.emplace_back();
+    c.addr = d.config->addr;
+    c.model = d.config->model;
+    std::copy(d.config->key, d.config->key + key_size(d.config->model), c.key.begin());
+    c.state_topic = d.config->state_topic;
+    c.off_topic = d.config->off_topic;
+    c.start_topic = d.config->start_topic;
+    c.bind();
+    d.config = &c.config;
+    d.removed = true;
+    unsubscribe_device(d);
+    if (d.poll_source) {
+        sd_event_source_set_enabled(d.poll_source, SD_EVENT_OFF);
     }
-    uint8_t *space = nullptr;
-    r = sd_bus_message_append_array_space(m, 'y', value.size() + 3, (void **)&space);
-    if (r < 0) {
-        LOG("write_value: failed to push method parameters - data: {}", strerror(-r));
-        return;
+    for (auto &c : d.commands) {
+        publish_command_status(d, c, "cancelled");
     }
-    uint8_t req_num = g.device_state.ctr++;
-    space[0] = 0x55;
-    space[1] = req_num;
-    memcpy(&space[2], value.data(), value.size());
-    space[2 + value.size()] = 0xaa;
-    r = sd_bus_message_append(m, "a{sv}", 1, "type", "s", "command");
-    if (r < 0) {
-        LOG("write_value: failed to push method parameters - options: {}", strerror(-r));
-        return;
+    d.commands.clear();
+    if (d.link.connected) {
+        disconnect(d);
     }
-    g.request_handlers[req_num] = then;
-    sd_bus_call_async(g.bus, nullptr, m, nullptr, nullptr, to_us(WRITE_VALUE_TIMEOUT).count());
-    sd_event_add_time_relative(g.event, nullptr, CLOCK_MONOTONIC, to_us(2s).count(), 0, [](sd_event_source *s, uint64_t usec, void *userdata){
-        auto req_num = (uint8_t)(intptr_t)userdata;
-        auto node = g.request_handlers.extract(req_num);
-        if (!node.empty()) {
-            LOG("Timed out writing request {}", (int)req_num);
-            disconnect();
-            // node.mapped()();
-        }
-        return 0;
-    }, (void *)(uintptr_t)req_num);
-    sd_bus_message_unrefp(&m);
+    untrack_device(d);
+    d.rx_slot = sd_bus_slot_unref(d.rx_slot);
+    // Looked up again if the device comes back
+    d.device_path.clear();
+    d.rx_path.clear();
+    d.tx_path.clear();
 }
 
-void start_notify(std::function<void()> then) {
-    if (g.device_state.state >= Authorized) {
-        then();
+struct ReloadReport {
+    int added = 0;
+    int removed = 0;
+    int changed = 0;
+    int reconnects = 0;
+    bool broker = false;
+};
+
+// Moves a device to its new config. Only a different key or model costs the link, as the session was
+// authorized with the old one.
+void reconfigure_device(Device &d, const DeviceConfig &config, ReloadReport &report) {
+    const DeviceConfig &old = *d.config;
+    bool topics = strcmp(old.off_topic, config.off_topic) != 0 || strcmp(old.start_topic, config.start_topic) != 0;
+    bool state_topic = strcmp(old.state_topic, config.state_topic) != 0;
+    bool auth = old.model != config.model || !std::equal(old.key, old.key + key_size(old.model), config.key, config.key + key_size(config.model));
+    if (d.removed) {
+        const DeviceConfig *retired = d.config;
+        d.config = &config;
+        g.retired.remove_if([&](auto &c){ return &c.config == retired; });
+        d.removed = false;
+        subscribe_device(d);
+        schedule_polls(d);
+        report.added++;
         return;
     }
-
-    LOG("Starting notify on RX");
-    sd_bus_call_method_async(g.bus, nullptr, "org.bluez", g.rx_path.c_str(),
-                             "org.bluez.GattCharacteristic1", "StartNotify",
-                             [](sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-        LOG("Finished starting notify on RX");
-        if (ret_error && ret_error->message) {
-         LOG(": {}", ret_error->message);
-        }
-        LOG("");
-        auto *f = (std::function<void()> *) userdata;
-        (*f)();
-        return 0;
-    }, new std::function<void()>(std::move(then)), "");
+    if (topics) {
+        unsubscribe_device(d);
+    }
+    d.config = &config;
+    if (topics) {
+        subscribe_device(d);
+    }
+    if (auth && d.link.connected) {
+        LOG("Key or model of {} changed, reconnecting", config.addr);
+        disconnect(d);
+        report.reconnects++;
+    }
+    // Subscribers of the new topic have nothing retained yet
+    if (state_topic && owns_lease(d)) {
+        d.publish();
+    }
+    report.changed += topics || state_topic || auth;
 }
 
-void authorize(const std::function<void()>& then) {
-    if (g.device_state.state >= Authorized) {
-        then();
+// Re-reads the config file and applies only what changed: devices not listed anymore are dropped, new ones
+// start polling, others keep their link unless their key or model changed
+void reload_config(std::string_view requester) {
+    auto start = std::chrono::steady_clock::now();
+    auto next = read_settings();
+    std::string request_id = requester.empty() ? "" : FMT(", \"request_id\": {}", std::quoted(requester));
+    int mid = -1;
+    if (!next) {
+        std::string result_json = FMT("{{ \"action\": \"reload\", \"status\": \"invalid\"{}}}", request_id);
+        mosquitto_publish(g.mqtt, &mid, M223S_CONTROL_RESULT_TOPIC, result_json.size(), result_json.c_str(), 1, false);
         return;
     }
-    start_notify([=]{
-        LOG("Writing authorization request...");
-        std::vector<uint8_t> cmd{CMD_CODE_AUTH};
-        std::copy(std::begin(M223S_KEY), std::end(M223S_KEY), std::back_inserter(cmd));
-        write_request(cmd, [=]{
-            LOG("Authorization request sent");
-            then();
+    // Devices still point into the previous settings until they're moved over or retired
+    Settings previous = std::move(g.settings);
+    g.settings = std::move(*next);
+    ReloadReport report;
+    std::vector<const DeviceConfig *> configs;
+    for (auto &c : g.settings.devices) {
+        c.bind();
+        configs.push_back(&c.config);
+    }
+    if (configs.empty()) {
+        for (auto &c : DEVICES) {
+            configs.push_back(&c);
+        }
+    }
+    for (auto *config : configs) {
+        auto it = std::find_if(g.devices.begin(), g.devices.end(), [&](auto &d){
+            return strcmp(d->config->addr, config->addr) == 0 && !is_enrolled(*d);
         });
-    });
+        if (it != g.devices.end()) {
+            reconfigure_device(**it, *config, report);
+            continue;
+        }
+        auto &d = add_device(*config);
+        if (g.mqtt_connected) {
+            subscribe_device(d);
+        }
+        schedule_polls(d);
+        report.added++;
+    }
+    for (auto &d : g.devices) {
+        bool listed = std::any_of(configs.begin(), configs.end(), [&](auto *c){ return c == d->config; });
+        if (!listed && !d->removed && !is_enrolled(*d)) {
+            retire_device(*d);
+            report.removed++;
+        }
+    }
+    if (enrollment_enabled() && !g.adapters.empty()) {
+        start_enrollment();
+    }
+    if (g.settings.polling_interval != previous.polling_interval) {
+        for (auto &d : g.devices) {
+            if (!d->removed && !d->pairing) {
+                schedule_polls(*d);
+            }
+        }
+    }
+    if (g.settings.broker_host != previous.broker_host || g.settings.broker_port != previous.broker_port) {
+        LOG("Connecting to broker {}:{}", g.settings.broker_host, g.settings.broker_port);
+        // The loop thread owns the connection, stop it before connecting elsewhere
+        mosquitto_disconnect(g.mqtt);
+        mosquitto_loop_stop(g.mqtt, false);
+        mosquitto_connect_async(g.mqtt, g.settings.broker_host.c_str(), g.settings.broker_port, MQTT_KEEPALIVE);
+        mosquitto_loop_start(g.mqtt);
+        report.broker = true;
+    }
+    auto time = to_us(std::chrono::steady_clock::now() - start);
+    g.metrics.reload.add(time);
+    g.metrics.reload_reconnects += report.reconnects;
+    LOG("Reloaded config in {} us: {} added, {} removed, {} changed, {} reconnects", time.count(), report.added,
+        report.removed, report.changed, report.reconnects);
+    std::string result_json = FMT("{{ \"action\": \"reload\", \"status\": \"done\", \"time_us\": {}, "
+                                  "\"added\": {}, \"removed\": {}, \"changed\": {}, \"reconnects\": {}, "
+                                  "\"broker_reconnect\": {}{}}}",
+                                  time.count(), report.added, report.removed, report.changed, report.reconnects,
+                                  report.broker, request_id);
+    mosquitto_publish(g.mqtt, &mid, M223S_CONTROL_RESULT_TOPIC, result_json.size(), result_json.c_str(), 1, false);
 }
 
-void query() {
-    LOG("Sending ping");
-    write_request({CMD_CODE_PING}, []{
-        LOG("Sent ping, sending query");
-        write_request({CMD_CODE_QUERY}, []{
-            LOG("Sent query");
-        });
-    });
+// Deferred work, dispatched only when no command or state source is ready
+void run_housekeeping() {
+    if (g.housekeeping_since) {
+        g.metrics.dispatch_housekeeping.add(to_us(std::chrono::steady_clock::now() - *g.housekeeping_since));
+        g.housekeeping_since.reset();
+    }
+    for (auto &a : g.adapters) {
+        resume_discovery(a);
+    }
+    auto messages = std::move(g.deferred_messages);
+    g.deferred_messages.clear();
+    for (auto &msg : messages) {
+        on_mqtt_message(msg);
+    }
 }
 
-void turnoff() {
-    LOG("Sending turnoff");
-    write_request({CMD_CODE_OFF}, []{
-        LOG("Sent turnoff");
-    });
+// Busy-loops in a state priority timer, see SYNTHETIC_LOAD_PERIOD
+void start_synthetic_load() {
+    sd_event_source *load = nullptr;
+    sd_event_add_time_relative(g.event, &load, CLOCK_MONOTONIC, to_us(SYNTHETIC_LOAD_PERIOD).count(), 0, [](sd_event_source *s, uint64_t usec, void *userdata){
+        auto until = std::chrono::steady_clock::now() + SYNTHETIC_LOAD_BUSY;
+        while (std::chrono::steady_clock::now() < until) {
+        }
+        sd_event_source_set_enabled(s, SD_EVENT_ON);
+        sd_event_source_set_time_relative(s, to_us(SYNTHETIC_LOAD_PERIOD).count());
+        return 0;
+    }, nullptr);
+    float_source(load, PRIORITY_STATE);
 }
 
-void update_m223s_state() {
-    LOG("Updating M223S state");
-    g.device_path = wait_for_device();
-    if (!g.device_path.empty()) {
-        connect([](const std::string &path){
-            if (g.rx_path.empty() || g.tx_path.empty()) {
-                initialize_paths(path);
-            }
-            if (!g.rx_path.empty() && !g.tx_path.empty()) {
-                authorize([]{
-                    LOG("Ready");
-                    query();
-                });
-            } else {
-                LOG("Services not discovered yet");
+// Adapters are enumerated without blocking the loop, the broker connection proceeds meanwhile
+void enumerate_adapters() {
+    int r = sd_bus_call_method_async(g.bus, nullptr, "org.bluez", "/org/bluez", "org.freedesktop.DBus.Introspectable",
+                                     "Introspect", [](sd_bus_message *reply, void *userdata, sd_bus_error *ret_error){
+        const char *s = nullptr;
+        if (sd_bus_message_is_method_error(reply, nullptr) || sd_bus_message_read(reply, "s", &s) < 0 || !s) {
+            LOG("Can't enumerate adapters");
+        } else {
+            IntrospectionScanner scanner(s);
+            while (auto element = scanner.next()) {
+                if (element->kind == IntrospectionScanner::Node) {
+                    g.adapters.push_back(Adapter{std::string(element->name), FMT("/org/bluez/{}", element->name)});
+                }
             }
-        });
-    } else {
-        LOG("Device not found");
+        }
+        LOG("Found {} adapters", g.adapters.size());
+        g.metrics.mark(Adapters_enumerated);
+        start_polling();
+        if (enrollment_enabled()) {
+            start_enrollment();
+        }
+        return 0;
+    }, nullptr, "");
+    if (r < 0) {
+        LOG("Can't enumerate adapters: {}", strerror(-r));
+        start_polling();
+    }
+}
+
+// Republishes the last known state of our devices as soon as the broker accepts us
+void on_broker_connected() {
+    g.metrics.mark(Broker_connected);
+    for (auto &d : g.devices) {
+        if (d->removed) {
+            continue;
+        }
+        if (!d->pairing) {
+            subscribe_device(*d);
+        }
+        if (d->pairing || !owns_lease(*d)) {
+            continue;
+        }
+        if (d->restored ? d->restored_stale : LINK_POLICY == Always_connected || d->device_state.state >= Off) {
+            d->publish();
+        }
     }
 }
 
 int main() {
+    // SIGHUP is handled by the loop, every thread has to leave it blocked
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
     g.bus = init_sd_bus();
     sd_event_new(&g.event);
+    // Device notifications and D-Bus replies all arrive through the bus
+    sd_bus_attach_event(g.bus, g.event, PRIORITY_COMMANDS);
+    g.metrics.mark(Bus_opened);
     LOG("systemd sd-bus initialized");
 
-    g.mqtt = mosquitto_new(nullptr, true, nullptr);
+    if (const char *id = getenv("M223S_BRIDGE_ID")) {
+        g.bridge_id = id;
+    }
+    g.mqtt = mosquitto_new(g.bridge_id.empty() ? nullptr : g.bridge_id.c_str(), true, nullptr);
+    std::string bridge_topic = FMT("{}/{}", M223S_BRIDGES_TOPIC, g.bridge_id);
+    if (!g.bridge_id.empty()) {
+        // Lease expiry needs MQTT v5, a single instance keeps working with v3.1.1 brokers
+        mosquitto_int_option(g.mqtt, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+        // Clearing our retained presence on unclean exit releases all our leases at once
+        mosquitto_will_set_v5(g.mqtt, bridge_topic.c_str(), 0, nullptr, 1, true, nullptr);
+    }
     LOG("mqtt initialized");
+    g.inbox_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    mkdir(STATE_DIR, 0755);
 
-    g.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-
-    g.adapters = introspect("org.bluez", "/org/bluez").first;
-    LOG("Found {} adapters", g.adapters.size());
+    if (auto settings = read_settings()) {
+        g.settings = std::move(*settings);
+    } else {
+        LOG("Using the built-in config");
+    }
+    for (auto &c : g.settings.devices) {
+        c.bind();
+        add_device(c.config);
+    }
+    if (g.settings.devices.empty()) {
+        for (auto &config : DEVICES) {
+            add_device(config);
+        }
+    }
+    load_enrolled();
+    compile_rules();
+    load_schedule();
 
+    // Device topics are subscribed from the loop in on_broker_connected(), devices may be enrolled meanwhile
     mosquitto_connect_callback_set(g.mqtt, [](mosquitto *, void *, int){
-        int off_mid = -1;
-        mosquitto_subscribe(g.mqtt, &off_mid, M223S_OFF_TOPIC, true);
+        int history_mid = -1;
+        mosquitto_subscribe(g.mqtt, &history_mid, M223S_HISTORY_TOPIC, 1);
+        mosquitto_subscribe(g.mqtt, &history_mid, M223S_SCHEDULE_TOPIC, 1);
+        mosquitto_subscribe(g.mqtt, &history_mid, M223S_CONTROL_TOPIC, 1);
+        if (!g.bridge_id.empty()) {
+            int mid = -1;
+            std::string bridge_topic = FMT("{}/{}", M223S_BRIDGES_TOPIC, g.bridge_id);
+            mosquitto_publish(g.mqtt, &mid, bridge_topic.c_str(), 6, "online", 1, true);
+            // Retained presence is delivered before leases, so lease owners are known when leases arrive
+            mosquitto_subscribe(g.mqtt, &mid, FMT("{}/+", M223S_BRIDGES_TOPIC).c_str(), 1);
+            mosquitto_subscribe(g.mqtt, &mid, FMT("{}/+", M223S_LEASE_TOPIC).c_str(), 1);
+        }
+        g.mqtt_connected = true;
+        g.broker_accepted = true;
+        int64_t value = 1;
+        write(g.inbox_fd, &value, sizeof(value));
     });
     mosquitto_disconnect_callback_set(g.mqtt, [](mosquitto *, void *, int){
         LOG("mqtt: disconnected");
+        g.mqtt_connected = false;
     });
     mosquitto_message_callback_set(g.mqtt, [](mosquitto *, void *, const mosquitto_message *msg){
         LOG("mqtt: message received: {}", msg->topic);
+        {
+            std::lock_guard lock(g.inbox_mutex);
+            g.inbox.push_back(MqttMessage{msg->topic, std::string((const char *)msg->payload, msg->payloadlen),
+                                          std::chrono::steady_clock::now()});
+        }
         int64_t value = 1;
-        write(g.event_fd, &value, sizeof(value));
+        write(g.inbox_fd, &value, sizeof(value));
     });
     mosquitto_log_callback_set(g.mqtt, [](mosquitto *mst, void *arg, int, const char *msg) {
         LOG("mqtt: {}", msg);
     });
+    // The broker connection is set up on the mosquitto thread while the loop enumerates adapters
+    mosquitto_connect_async(g.mqtt, g.settings.broker_host.c_str(), g.settings.broker_port, MQTT_KEEPALIVE);
+    mosquitto_loop_start(g.mqtt);
 
-    sd_event_add_time_relative(g.event, nullptr, CLOCK_MONOTONIC, 0, 0, [](sd_event_source *s, uint64_t usec, void *userdata){
-        if (g.device_state.ctr * POLLING_INTERVAL > 24h) {
-            disconnect();
+    sd_event_source *source = nullptr;
+    sd_event_add_io(g.event, &source, g.inbox_fd, EPOLLIN, [](sd_event_source *s, int fd, uint32_t revents, void *userdata){
+        int64_t value = 0;
+        read(g.inbox_fd, &value, sizeof(value));
+        if (g.broker_accepted.exchange(false)) {
+            on_broker_connected();
+        }
+        std::vector<MqttMessage> inbox;
+        {
+            std::lock_guard lock(g.inbox_mutex);
+            inbox.swap(g.inbox);
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (auto &msg : inbox) {
+            g.metrics.dispatch_commands.add(to_us(now - msg.received));
+            // History answers can be large, they wait until commands and polls are done
+            if (msg.topic == M223S_HISTORY_TOPIC) {
+                g.deferred_messages.push_back(std::move(msg));
+                schedule_housekeeping();
+                continue;
+            }
+            on_mqtt_message(msg);
         }
-        update_m223s_state();
+        return 0;
+    }, nullptr);
+    float_source(source, PRIORITY_COMMANDS);
+    sd_event_add_defer(g.event, &g.housekeeping_source, [](sd_event_source *s, void *userdata){
+        run_housekeeping();
+        return 0;
+    }, nullptr);
+    sd_event_source_set_priority(g.housekeeping_source, PRIORITY_HOUSEKEEPING);
+    sd_event_source_set_enabled(g.housekeeping_source, SD_EVENT_OFF);
+    sd_event_add_time_relative(g.event, &source, CLOCK_MONOTONIC, to_us(g.settings.metrics_interval).count(), 0, [](sd_event_source *s, uint64_t usec, void *userdata){
+        g.metrics.publish();
         sd_event_source_set_enabled(s, SD_EVENT_ON);
-        sd_event_source_set_time_relative(s, to_us(POLLING_INTERVAL).count());
+        sd_event_source_set_time_relative(s, to_us(g.settings.metrics_interval).count());
         return 0;
     }, nullptr);
-    sd_event_add_io(g.event, nullptr, g.event_fd, EPOLLIN, [](sd_event_source *s, int fd, uint32_t revents, void *userdata){
-        int64_t value = 0;
-        read(g.event_fd, &value, sizeof(value));
-        turnoff();
+    float_source(source, PRIORITY_HOUSEKEEPING);
+    sd_event_add_signal(g.event, &source, SIGHUP, [](sd_event_source *s, const struct signalfd_siginfo *si, void *userdata){
+        LOG("SIGHUP received, reloading config");
+        reload_config("");
         return 0;
     }, nullptr);
+    float_source(source, PRIORITY_HOUSEKEEPING);
+    if (!g.bridge_id.empty()) {
+        sd_event_add_time_relative(g.event, &source, CLOCK_MONOTONIC, to_us(LEASE_RENEW_INTERVAL).count(), 0, [](sd_event_source *s, uint64_t usec, void *userdata){
+            for (auto &d : g.devices) {
+                if (!d->removed && g.mqtt_connected && owns_lease(*d) && !unreachable(*d)) {
+                    publish_lease(*d);
+                }
+            }
+            sd_event_source_set_enabled(s, SD_EVENT_ON);
+            sd_event_source_set_time_relative(s, to_us(LEASE_RENEW_INTERVAL).count());
+            return 0;
+        }, nullptr);
+        float_source(source, PRIORITY_STATE);
+    }
+    if (SYNTHETIC_LOAD_PERIOD > 0ms) {
+        start_synthetic_load();
+    }
 
-    mosquitto_connect_async(g.mqtt, "127.0.0.1", 1883, 30);
-    mosquitto_loop_start(g.mqtt);
-    sd_event_loop(g.event);
+    enumerate_adapters();
+    while (sd_event_run(g.event, UINT64_MAX) >= 0) {
+        // Temporaries of the dispatch are dropped all at once
+        g.arena.release();
+        g.metrics.dispatches++;
+    }
     return 0;
 }